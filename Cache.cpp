@@ -0,0 +1,326 @@
+#include "Cache.hpp"
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// name of the function inside a cache entry
+static const char *const kCachedName = "obfus.cached";
+// bump when the entry layout or the transforms change
+static const char *const kCacheVersion = "obfus-cache-2";
+// named metadata of an entry: {original name, undef pointer to the type} per
+// struct type, see EntryTypeRemapper
+static const char *const kTypesName = "obfus.types";
+
+// a declaration of global in module, with value_type
+static llvm::GlobalValue *Declare(llvm::Module &module, const llvm::GlobalValue &global, llvm::Type *value_type) {
+    if (const auto function_type = llvm::dyn_cast<llvm::FunctionType>(value_type)) {
+        return llvm::Function::Create(function_type, llvm::GlobalValue::ExternalLinkage, global.getAddressSpace(), global.getName(), &module);
+    }
+    const auto variable = llvm::dyn_cast<llvm::GlobalVariable>(&global);
+    return new llvm::GlobalVariable(module, value_type, variable && variable->isConstant(), llvm::GlobalValue::ExternalLinkage, nullptr,
+                                    global.getName(), nullptr, global.getThreadLocalMode(), global.getAddressSpace());
+}
+
+// everything the cloned function references becomes a declaration of the
+// same name, which a hit resolves to the real thing again
+struct DeclarationMaterializer : llvm::ValueMaterializer {
+    explicit DeclarationMaterializer(llvm::Module &module) : module(module) {}
+
+    llvm::Value *materialize(llvm::Value *value) override {
+        const auto global = llvm::dyn_cast<llvm::GlobalValue>(value);
+        if (!global) {
+            return nullptr;
+        }
+        // nothing to find it by again
+        if (!global->hasName()) {
+            unsupported = true;
+        }
+        return Declare(module, *global, global->getValueType());
+    }
+
+    llvm::Module &module;
+    bool unsupported = false;
+};
+
+/*
+Struct types are named and belong to the context, so the bitcode reader gives
+every struct type of an entry a new name (%struct.foo.42) next to the
+module's own %struct.foo.  The names the entry was written with are the ones
+the module has now (they are part of the key), this maps the reader's types
+back to them, and the types built from them.
+*/
+class EntryTypeRemapper : public llvm::ValueMapTypeRemapper {
+   public:
+    // false if a type is gone or the entry is malformed
+    bool Read(const llvm::Module &entry) {
+        const auto types = entry.getNamedMetadata(kTypesName);
+        if (!types) {
+            return true;
+        }
+        for (const auto node : types->operands()) {
+            if (node->getNumOperands() != 2) {
+                return false;
+            }
+            const auto name = llvm::dyn_cast<llvm::MDString>(node->getOperand(0));
+            const auto value = llvm::dyn_cast<llvm::ConstantAsMetadata>(node->getOperand(1));
+            if (!name || !value || !value->getType()->isPointerTy()) {
+                return false;
+            }
+#if LLVM_VERSION_MAJOR >= 12
+            const auto existing = llvm::StructType::getTypeByName(entry.getContext(), name->getString());
+#else
+            const auto existing = entry.getTypeByName(name->getString());
+#endif
+            if (!existing) {
+                return false;
+            }
+            types_[value->getType()->getPointerElementType()] = existing;
+        }
+        return true;
+    }
+
+    llvm::Type *remapType(llvm::Type *type) override {
+        const auto found = types_.find(type);
+        if (found != types_.end()) {
+            return found->second;
+        }
+        // other named structs are the module's already, and may be recursive
+        const auto struct_type = llvm::dyn_cast<llvm::StructType>(type);
+        if (struct_type && !struct_type->isLiteral()) {
+            return type;
+        }
+
+        llvm::SmallVector<llvm::Type *, 8> elements;
+        bool changed = false;
+        for (const auto element : type->subtypes()) {
+            elements.emplace_back(remapType(element));
+            changed |= elements.back() != element;
+        }
+        llvm::Type *mapped = type;
+        if (changed) {
+            if (type->isPointerTy()) {
+                mapped = llvm::PointerType::get(elements[0], type->getPointerAddressSpace());
+            } else if (type->isArrayTy()) {
+                mapped = llvm::ArrayType::get(elements[0], type->getArrayNumElements());
+            } else if (const auto vector_type = llvm::dyn_cast<llvm::VectorType>(type)) {
+                mapped = llvm::VectorType::get(elements[0], vector_type->getElementCount());
+            } else if (const auto function_type = llvm::dyn_cast<llvm::FunctionType>(type)) {
+                mapped = llvm::FunctionType::get(elements[0], llvm::makeArrayRef(elements).drop_front(), function_type->isVarArg());
+            } else if (struct_type) {
+                mapped = llvm::StructType::get(type->getContext(), elements, struct_type->isPacked());
+            }
+        }
+        types_[type] = mapped;
+        return mapped;
+    }
+
+   private:
+    llvm::DenseMap<llvm::Type *, llvm::Type *> types_;
+};
+
+// F alone in a new module as kCachedName, nullptr and why if it cannot be
+// cached
+static std::unique_ptr<llvm::Module> ExtractFunction(const llvm::Function &F, std::string &reason) {
+    // the entry would need the compile unit and every scope remapped on a hit
+    if (F.getSubprogram()) {
+        reason = "it has debug info";
+        return nullptr;
+    }
+    // blockaddress constants only live in the module of their function
+    for (const auto &BB : F) {
+        if (BB.hasAddressTaken()) {
+            reason = "it has address taken blocks";
+            return nullptr;
+        }
+    }
+
+    const auto &M = *F.getParent();
+    auto &context = F.getContext();
+    auto module = std::make_unique<llvm::Module>(kCachedName, context);
+    module->setDataLayout(M.getDataLayout());
+    module->setTargetTriple(M.getTargetTriple());
+    const auto cached = llvm::Function::Create(F.getFunctionType(), llvm::GlobalValue::ExternalLinkage, F.getAddressSpace(), kCachedName, module.get());
+
+    llvm::ValueToValueMapTy VMap;
+    VMap[&F] = cached;
+    auto cached_arg = cached->arg_begin();
+    for (const auto &arg : F.args()) {
+        cached_arg->setName(arg.getName());
+        VMap[&arg] = &*cached_arg++;
+    }
+    DeclarationMaterializer materializer(*module);
+    llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+#if LLVM_VERSION_MAJOR >= 13
+    llvm::CloneFunctionInto(cached, &F, VMap, llvm::CloneFunctionChangeType::DifferentModule, returns, "", nullptr, nullptr, &materializer);
+#else
+    llvm::CloneFunctionInto(cached, &F, VMap, true, returns, "", nullptr, nullptr, &materializer);
+#endif
+    if (materializer.unsupported) {
+        reason = "it uses an unnamed global";
+        return nullptr;
+    }
+    // cloning into another module lists the compile units there, F has none
+    if (const auto units = module->getNamedMetadata("llvm.dbg.cu")) {
+        module->eraseNamedMetadata(units);
+    }
+
+    const auto types = module->getOrInsertNamedMetadata(kTypesName);
+    for (const auto type : module->getIdentifiedStructTypes()) {
+        if (!type->hasName()) {
+            reason = "it uses an unnamed struct type";
+            return nullptr;
+        }
+        llvm::Metadata *operands[] = {llvm::MDString::get(context, type->getName()),
+                                      llvm::ConstantAsMetadata::get(llvm::UndefValue::get(type->getPointerTo()))};
+        types->addOperand(llvm::MDTuple::get(context, operands));
+    }
+    // without it the reader warns and strips debug info, even if there is none
+    module->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+    return module;
+}
+
+namespace obfus {
+std::string FunctionCache::Key(const llvm::Function &F, const llvm::StringRef config, std::string &reason) {
+    const auto module = ExtractFunction(F, reason);
+    if (!module) {
+        return "";
+    }
+    std::string text;
+    llvm::raw_string_ostream stream(text);
+    stream << kCacheVersion << "\n"
+           << config << "\n";
+    module->print(stream, nullptr);
+    return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(stream.str())), true);
+}
+
+std::string FunctionCache::Path(const llvm::StringRef key) const {
+    llvm::SmallString<128> path(directory_);
+    llvm::sys::path::append(path, "llvmcache-" + key);
+    return std::string(path.str());
+}
+
+bool FunctionCache::Restore(const llvm::StringRef key, llvm::Function &F) const {
+    const auto path = Path(key);
+    int fd;
+    if (llvm::sys::fs::openFileForRead(path, fd)) {
+        return false;
+    }
+    auto buffer = llvm::MemoryBuffer::getOpenFile(llvm::sys::fs::convertFDToNativeFile(fd), path, -1);
+    // the access time is what eviction goes by, and relatime may not update it
+    const auto now = std::chrono::system_clock::now();
+    llvm::sys::fs::setLastAccessAndModificationTime(fd, now, now);
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    if (!buffer) {
+        return false;
+    }
+    auto entry = llvm::parseBitcodeFile((*buffer)->getMemBufferRef(), F.getContext());
+    if (!entry) {
+        llvm::consumeError(entry.takeError());
+        return false;
+    }
+    const auto cached = (*entry)->getFunction(kCachedName);
+    EntryTypeRemapper types;
+    if (!cached || cached->isDeclaration() || !types.Read(**entry) || types.remapType(cached->getFunctionType()) != F.getFunctionType()) {
+        return false;
+    }
+
+    // declarations resolve by name, intrinsics the module does not use yet
+    // get declared
+    auto &M = *F.getParent();
+    llvm::ValueToValueMapTy VMap;
+    for (const auto &global : (*entry)->global_values()) {
+        if (&global == cached) {
+            continue;
+        }
+        llvm::Constant *existing = M.getNamedValue(global.getName());
+        if (!existing) {
+            existing = Declare(M, global, types.remapType(global.getValueType()));
+        }
+        const auto type = types.remapType(global.getType());
+        VMap[&global] = (existing->getType() == type) ? existing : llvm::ConstantExpr::getBitCast(existing, type);
+    }
+    VMap[cached] = &F;
+    for (size_t i = 0; i < F.arg_size(); i++) {
+        VMap[cached->getArg(i)] = F.getArg(i);
+    }
+
+    // cloning copies the entry's attributes and metadata over F's, they are
+    // the same but would refer to the entry's types and distinct nodes
+    const auto attributes = F.getAttributes();
+    llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 4> metadata;
+    F.getAllMetadata(metadata);
+    for (auto &BB : F) {
+        BB.dropAllReferences();
+    }
+    while (!F.empty()) {
+        F.back().eraseFromParent();
+    }
+    llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+#if LLVM_VERSION_MAJOR >= 13
+    llvm::CloneFunctionInto(&F, cached, VMap, llvm::CloneFunctionChangeType::GlobalChanges, returns, "", nullptr, &types);
+#else
+    llvm::CloneFunctionInto(&F, cached, VMap, true, returns, "", nullptr, &types);
+#endif
+    F.setAttributes(attributes);
+    F.clearMetadata();
+    for (const auto &attachment : metadata) {
+        F.addMetadata(attachment.first, *attachment.second);
+    }
+    return true;
+}
+
+void FunctionCache::Store(const llvm::StringRef key, const llvm::Function &F, std::string &reason) const {
+    const auto module = ExtractFunction(F, reason);
+    if (!module || llvm::sys::fs::create_directories(directory_)) {
+        return;
+    }
+
+    // written under a unique name and renamed, other compilers may be
+    // reading or writing the same entry
+    int fd;
+    llvm::SmallString<128> temporary;
+    if (llvm::sys::fs::createUniqueFile(directory_ + "/obfus-%%%%%%%%.tmp", fd, temporary)) {
+        return;
+    }
+    {
+        llvm::raw_fd_ostream stream(fd, true);
+        llvm::WriteBitcodeToFile(*module, stream);
+        if (stream.has_error()) {
+            stream.clear_error();
+            llvm::sys::fs::remove(temporary);
+            return;
+        }
+    }
+    if (llvm::sys::fs::rename(temporary, Path(key))) {
+        llvm::sys::fs::remove(temporary);
+        return;
+    }
+    // only does work once per prune interval
+    llvm::pruneCache(directory_, policy_);
+}
+}  // namespace obfus
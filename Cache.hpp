@@ -0,0 +1,48 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Function.h>
+#include <llvm/Support/CachePruning.h>
+
+#include <string>
+#include <utility>
+
+namespace obfus {
+/*
+On-disk cache of obfuscated function bodies for incremental builds.  The key
+is a SHA1 of the function before obfuscation, cloned alone into a module of
+its own (so the rest of the file does not shift its metadata numbering),
+together with a config string the caller builds from everything else the
+result depends on (name, seed, level, options, hot blocks, budget).  Entries
+are that module after obfuscation, as bitcode named llvmcache-<key> so
+llvm::pruneCache can evict them by size and age like a ThinLTO cache.
+
+Functions with debug info or address taken blocks are not cached: their
+subprogram and block addresses do not survive being moved between modules.
+That leaves out every function of a -g build, and with flatten=indirectbr
+every flattened one, as the blockaddress table only exists after the
+transform.  Key and Store say why, the pass counts and reports them.
+*/
+class FunctionCache {
+   public:
+    FunctionCache(std::string directory, llvm::CachePruningPolicy policy) : directory_(std::move(directory)), policy_(policy) {}
+
+    // empty when F cannot be cached, reason says why
+    static std::string Key(const llvm::Function &F, llvm::StringRef config, std::string &reason);
+
+    // on a hit the body of F is replaced by the cached one
+    bool Restore(llvm::StringRef key, llvm::Function &F) const;
+    // F after obfuscation, then evicts old entries if the policy says so.
+    // reason is set when F cannot be cached
+    void Store(llvm::StringRef key, const llvm::Function &F, std::string &reason) const;
+
+   private:
+    std::string Path(llvm::StringRef key) const;
+
+    std::string directory_;
+    llvm::CachePruningPolicy policy_;
+};
+}  // namespace obfus
+
+#endif
@@ -0,0 +1,103 @@
+#include "CostBudget.hpp"
+
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Instruction.h>
+
+#include <algorithm>
+#include <utility>
+
+// instructions the target can not cost are counted as 1
+static int64_t GetInstructionCost(const llvm::TargetTransformInfo &TTI, const llvm::Instruction &I) {
+#if LLVM_VERSION_MAJOR >= 12
+    const auto cost = TTI.getInstructionCost(&I, llvm::TargetTransformInfo::TCK_Latency);
+    return cost.isValid() ? std::max<int64_t>(*cost.getValue(), 0) : 1;
+#else
+    const int cost = TTI.getInstructionCost(&I, llvm::TargetTransformInfo::TCK_Latency);
+    return (cost >= 0) ? cost : 1;
+#endif
+}
+
+namespace obfus {
+CostBudget::CostBudget(const llvm::TargetTransformInfo &TTI, llvm::DenseMap<const llvm::BasicBlock *, double> weights, const double budget)
+    : TTI_(TTI), weights_(std::move(weights)), budget_(budget) {
+    for (const auto &weight : weights_) {
+        weighted_.emplace_back(const_cast<llvm::BasicBlock *>(weight.first));
+    }
+}
+
+double CostBudget::FunctionCost(const llvm::TargetTransformInfo &TTI, const llvm::Function &F,
+                                const llvm::DenseMap<const llvm::BasicBlock *, double> &weights) {
+    double cost = 0;
+    for (const auto &BB : F) {
+        const auto weight = weights.find(&BB);
+        int64_t block_cost = 0;
+        for (const auto &I : BB) {
+            block_cost += GetInstructionCost(TTI, I);
+        }
+        cost += block_cost * ((weight != weights.end()) ? weight->second : 1.0);
+    }
+    return cost;
+}
+
+double CostBudget::Weight(const llvm::BasicBlock &BB) const {
+    const auto weight = weights_.find(&BB);
+    return (weight != weights_.end()) ? weight->second : 1.0;
+}
+
+void CostBudget::InheritWeight(const llvm::BasicBlock &BB, const llvm::BasicBlock &from) {
+    weights_[&BB] = Weight(from);
+    weighted_.emplace_back(const_cast<llvm::BasicBlock *>(&BB));
+}
+
+void CostBudget::SumWeights(const llvm::BasicBlock &BB, llvm::ArrayRef<llvm::BasicBlock *> blocks) {
+    double weight = 0;
+    for (const auto block : blocks) {
+        weight += Weight(*block);
+    }
+    weights_[&BB] = weight;
+    weighted_.emplace_back(const_cast<llvm::BasicBlock *>(&BB));
+}
+
+void CostBudget::Prune() {
+    // an address may be listed twice, erased and then reused, and the entry
+    // belongs to the live block
+    llvm::DenseMap<const llvm::BasicBlock *, double> weights;
+    std::vector<llvm::WeakVH> weighted;
+    for (const auto &handle : weighted_) {
+        if (handle) {
+            const auto BB = llvm::cast<llvm::BasicBlock>(handle);
+            if (weights.try_emplace(BB, weights_.lookup(BB)).second) {
+                weighted.emplace_back(handle);
+            }
+        }
+    }
+    weights_ = std::move(weights);
+    weighted_ = std::move(weighted);
+}
+
+bool CostBudget::CanAfford(const llvm::BasicBlock &BB, const int identities_count, const int vars_count) const {
+    if (budget_ < 0) {
+        return true;
+    }
+    const double estimate = identities_count * identity_cost_[std::min(vars_count, kMaxMBAVars)] * Weight(BB);
+    return spent_ + estimate <= budget_;
+}
+
+void CostBudget::Charge(llvm::BasicBlock::iterator begin, const llvm::BasicBlock::iterator end, const int identities_count, const int vars_count) {
+    if (begin == end) {
+        return;
+    }
+    int64_t cost = 0;
+    for (; begin != end; ++begin) {
+        cost += GetInstructionCost(TTI_, *begin);
+    }
+    spent_ += cost * Weight(*end->getParent());
+
+    // the estimate only grows: identities of the same size vary by 2x, and
+    // an average lets the rewrite that uses up the budget overshoot it
+    if (identities_count > 0) {
+        const int index = std::min(vars_count, kMaxMBAVars);
+        identity_cost_[index] = std::max(identity_cost_[index], static_cast<double>(cost) / identities_count);
+    }
+}
+}  // namespace obfus
@@ -0,0 +1,72 @@
+#ifndef COST_BUDGET_HPP
+#define COST_BUDGET_HPP
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/ValueHandle.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "DeriveZeroMBA.hpp"
+
+namespace obfus {
+/*
+Per function limit on the runtime cost the MBA rewrites may add.
+Costs are TargetTransformInfo latency estimates (roughly cycles) weighted by
+how often each block runs per call, so the budget is in estimated added
+cycles per call.  The transforms ask CanAfford before each rewrite and
+Charge the instructions they actually emitted afterwards, which also keeps
+the per identity estimates honest.
+*/
+class CostBudget {
+   public:
+    // budget < 0 means unlimited
+    // weights are block frequencies relative to the entry block, blocks
+    // without one count as 1
+    CostBudget(const llvm::TargetTransformInfo &TTI, llvm::DenseMap<const llvm::BasicBlock *, double> weights, double budget);
+
+    // weighted cost of every instruction in F, used for percentage budgets
+    static double FunctionCost(const llvm::TargetTransformInfo &TTI, const llvm::Function &F,
+                               const llvm::DenseMap<const llvm::BasicBlock *, double> &weights);
+
+    // whether identities_count identities with vars_count variables in BB fit
+    bool CanAfford(const llvm::BasicBlock &BB, int identities_count, int vars_count) const;
+    // charge the instructions in [begin, end) which implement identities_count
+    // identities with vars_count variables
+    void Charge(llvm::BasicBlock::iterator begin, llvm::BasicBlock::iterator end, int identities_count, int vars_count);
+    // BB is new and runs exactly as often as from (e.g. split off it)
+    void InheritWeight(const llvm::BasicBlock &BB, const llvm::BasicBlock &from);
+    // BB is new and runs once for every run of each of blocks (a dispatcher)
+    void SumWeights(const llvm::BasicBlock &BB, llvm::ArrayRef<llvm::BasicBlock *> blocks);
+    // forgets the blocks erased since they got their weight, a new block may
+    // be allocated where one of them was
+    void Prune();
+
+    double Spent() const {
+        return spent_;
+    }
+    double Budget() const {
+        return budget_;
+    }
+
+   private:
+    double Weight(const llvm::BasicBlock &BB) const;
+
+    const llvm::TargetTransformInfo &TTI_;
+    llvm::DenseMap<const llvm::BasicBlock *, double> weights_;
+    // the blocks of weights_, null once erased
+    std::vector<llvm::WeakVH> weighted_;
+    double budget_;
+    double spent_ = 0;
+    // unweighted cost of the most expensive identity, indexed by variable
+    // count: starts from the largest seen on x86 (TTI latency, scalar
+    // and vector) and is raised by any identity measured above it
+    double identity_cost_[kMaxMBAVars + 1] = {0, 0, 8, 30, 36, 40, 44, 48, 52};
+};
+}  // namespace obfus
+
+#endif
@@ -2,7 +2,15 @@
 
 #include <llvm/IR/IRBuilder.h>
 
+#include <algorithm>
+#include <array>
+#include <bitset>
 #include <cmath>
+#include <cstdlib>
+#include <numeric>
+
+#include "Nullspace.hpp"
+#include "Random.hpp"
 
 /*
 https://vx-underground.org/papers/VXUG/Mirrors/ObfuscationwithMixedBooleanArithmeticExpressionsreconstructionanalysisandsimplificationtools.pdf
@@ -11,20 +19,54 @@ https://link.springer.com/chapter/10.1007/F978-3-540-77535-5_5
 
 /*
 columns = vars count
-This can be higher but we never use more than 3 due to
-performance reasons so it makes sense to just leave it as 3.
-If this is <= 3 FVEqualZero will be replaced with an unrolled
-expression which is very good for performance.
+Up to kMaxTableVars variables identities come from the precomputed tables (or
+the original bruteforce).  If this is <= 3 FVEqualZero will be replaced with
+an unrolled expression which is very good for performance.
+The integer nullspace solver handles up to kMaxVars, and always takes over
+above kMaxTableVars.
 */
-static const constexpr int kMaxVars = 3;
+static const constexpr int kMaxTableVars = 3;
 // rows = 2**vars
+static const constexpr int kMaxTableRows = 1 << kMaxTableVars;
+
+static const constexpr int kMaxVars = obfus::kMaxMBAVars;
 static const constexpr int kMaxRows = 1 << kMaxVars;
+// the solver stops adding columns at 3 * vars_count, past the 2 * vars_count
+// + 1 that always have a nullspace (see SolveIdentity)
+static const constexpr int kMaxTerms = 3 * kMaxVars;
+// columns on every edge of the variable path before the first solve, with
+// fewer most edges have no dependency yet and the loop solves once per column
+static const constexpr int kSolverEdgeTerms = 3;
+// random combinations of the nullspace basis use nonzero coefficients in
+// [-kSolverMaxMultiplier, kSolverMaxMultiplier] so no basis vector drops out
+static const constexpr int kSolverMaxMultiplier = 2;
+
+// a solver column: x op y, either operand and the result possibly negated,
+// or x alone when y < 0
+struct MBAOperation {
+    llvm::Instruction::BinaryOps opcode;
+    int x;
+    int y;
+    bool not_x;
+    bool not_y;
+    bool not_result;
+};
+
+// one column of F and its coefficient in the nullspace vector
+// bit j of rows = F[j][column].  table columns are lowered from their rows,
+// solver columns from the operation they were built from
+struct MBATerm {
+    std::bitset<kMaxRows> rows;
+    int64_t coefficient;
+    llvm::Optional<MBAOperation> operation;
+};
+using MBATerms = llvm::SmallVector<MBATerm, kMaxTerms>;
 
 // check if F * v = 0: used to check if nullspace attempt is correct
-static __attribute__((hot)) __attribute__((pure)) constexpr bool FVEqualsZero(const int matrix[kMaxRows][kMaxVars], const int vector[kMaxVars]) {
-    for (int row = 0; row < kMaxRows; row++) {
+static __attribute__((hot)) __attribute__((pure)) constexpr bool FVEqualsZero(const int matrix[kMaxTableRows][kMaxTableVars], const int vector[kMaxTableVars]) {
+    for (int row = 0; row < kMaxTableRows; row++) {
         int sum = 0;
-        for (int column = 0; column < kMaxVars; column++) {
+        for (int column = 0; column < kMaxTableVars; column++) {
             sum += matrix[row][column] * vector[column];
         }
         if (sum != 0) {
@@ -34,43 +76,150 @@ static __attribute__((hot)) __attribute__((pure)) constexpr bool FVEqualsZero(co
     return true;
 }
 
-namespace obfus {
+/*
+Precomputed identity tables.
+A valid (F, solution) pair has column 0 of F fixed to the high bit of the row
+index, the remaining columns free, and a +-1 solution with F * solution = 0.
+Because the rows are independent once the solution is chosen we can enumerate
+every pair at compile time by walking each sign pattern and taking the product
+of the valid choices for every row.  There are only 2 pairs for 2 variables and
+96 pairs for 3 variables so the tables are tiny.
+*/
 
-// generate expressions that equal 0 regardless of the value of the variables
-// pointers in vars should not be null
-// do not provide more than kMaxVars variables
-llvm::Value *GenerateRandomMBAIdentity(llvm::IRBuilder<> &builder, llvm::Type *type, const std::vector<llvm::Value *> &vars) {
-    // 5% performance improvement to be had from just assigning this
-    // to kMaxVars but that would assuming you always had kMaxVars
-    // variables.  leaving it as vars.size() for flexibility even
-    // though we will likely always have 3 variables but we may use
-    // 2 for some things in the future.
-    // also note that vars_count should never exceed kMaxVars
-    // if you want to use 4 variables (much slower), you need to
-    // adjust kMaxVars
-    const int vars_count = vars.size();      // columns
+// column i of F stored as a bitmask over the rows (bit j = F[j][i])
+struct MBAIdentity {
+    uint8_t columns[kMaxTableVars];
+    int8_t solution[kMaxTableVars];
+};
+static_assert(kMaxTableRows <= 8, "MBAIdentity columns must fit in a uint8_t");
+
+// signs bit j set means solution[j] = 1, otherwise -1 (same encoding as the
+// bruteforce below). free_bits holds columns 1..vars_count-1 of the row
+static constexpr bool RowIsValid(const int vars_count, const int signs, const int row, const int free_bits) {
+    int sum = (((row >> (vars_count - 1)) & 1) * ((((signs >> 0) & 1) * 2) - 1));
+    for (int j = 1; j < vars_count; j++) {
+        sum += ((free_bits >> (j - 1)) & 1) * ((((signs >> j) & 1) * 2) - 1);
+    }
+    return sum == 0;
+}
+
+static constexpr int CountRowChoices(const int vars_count, const int signs, const int row) {
+    int count = 0;
+    for (int free_bits = 0; free_bits < (1 << (vars_count - 1)); free_bits++) {
+        count += RowIsValid(vars_count, signs, row, free_bits);
+    }
+    return count;
+}
+
+static constexpr int CountIdentities(const int vars_count) {
+    int total = 0;
+    for (int signs = 0; signs < (1 << vars_count); signs++) {
+        int product = 1;
+        for (int row = 0; row < (1 << vars_count); row++) {
+            product *= CountRowChoices(vars_count, signs, row);
+        }
+        total += product;
+    }
+    return total;
+}
+
+template <int kVars>
+static constexpr std::array<MBAIdentity, CountIdentities(kVars)> BuildIdentityTable() {
+    std::array<MBAIdentity, CountIdentities(kVars)> table{};
+    int index = 0;
+    for (int signs = 0; signs < (1 << kVars); signs++) {
+        int product = 1;
+        for (int row = 0; row < (1 << kVars); row++) {
+            product *= CountRowChoices(kVars, signs, row);
+        }
+        // decode every combination of row choices as a mixed radix number
+        for (int combination = 0; combination < product; combination++) {
+            auto &entry = table[index++];
+            for (int j = 0; j < kVars; j++) {
+                entry.solution[j] = (((signs >> j) & 1) * 2) - 1;
+            }
+            int remaining = combination;
+            for (int row = 0; row < (1 << kVars); row++) {
+                const int choices = CountRowChoices(kVars, signs, row);
+                int digit = remaining % choices;
+                remaining /= choices;
+
+                int free_bits = 0;
+                for (;; free_bits++) {
+                    if (RowIsValid(kVars, signs, row, free_bits) && digit-- == 0) {
+                        break;
+                    }
+                }
+                entry.columns[0] |= ((row >> (kVars - 1)) & 1) << row;
+                for (int j = 1; j < kVars; j++) {
+                    entry.columns[j] |= ((free_bits >> (j - 1)) & 1) << row;
+                }
+            }
+        }
+    }
+    return table;
+}
+
+template <int kVars>
+static constexpr auto kIdentityTable = BuildIdentityTable<kVars>();
+
+// every entry must actually be in the nullspace
+template <int kVars>
+static constexpr bool IdentityTableIsValid() {
+    for (const auto &entry : kIdentityTable<kVars>) {
+        for (int row = 0; row < (1 << kVars); row++) {
+            int sum = 0;
+            for (int j = 0; j < kVars; j++) {
+                sum += ((entry.columns[j] >> row) & 1) * entry.solution[j];
+            }
+            if (sum != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(IdentityTableIsValid<2>() && IdentityTableIsValid<3>(), "invalid identity table entry");
+static_assert(kIdentityTable<2>.size() == 2, "unexpected 2 variable identity count");
+static_assert(kIdentityTable<3>.size() == 96, "unexpected 3 variable identity count");
+static_assert(kMaxTableVars == 3, "add a kIdentityTable case to PickTableIdentity for the new kMaxTableVars");
+
+static const MBAIdentity &PickTableIdentity(obfus::Random &rng, const int vars_count) {
+    switch (vars_count) {
+        case 2:
+            return kIdentityTable<2>[rng.Uniform(kIdentityTable<2>.size())];
+        default:
+            return kIdentityTable<3>[rng.Uniform(kIdentityTable<3>.size())];
+    }
+}
+
+// original approach: draw random columns until the +-1 bruteforce finds a
+// nullspace vector
+static MBAIdentity SampleIdentity(obfus::Random &rng, const int vars_count, uint64_t &retries) {
     const int rows_count = 1 << vars_count;  // 2**vars_count rows
-    // const int vars_count = kMaxVars;  // columns
-    // const int rows_count = kMaxRows;  // 2**vars_count rows
 
     // 2 choices - 1 or -1.  rows_count already has this value (2**vars_count)
     const int nullspace_attempts = rows_count;
 
-    int F[kMaxRows][kMaxVars] = {{0}};
-    int solutions[kMaxVars] = {0};
+    int F[kMaxTableRows][kMaxTableVars] = {{0}};
+    int solutions[kMaxTableVars] = {0};
 
     for (int i = 0; i < rows_count; i++) {
         // truth table: we dont unnecessarily recalculate every loop below
         F[i][0] = (i >> (vars_count - 1)) & 1;
     }
 
-    // use std::rand to generate seed for faster xorshift generator
+    // use rng to generate seed for faster xorshift generator
     // generating valid solutions is the main bottleneck so we need
-    // it to be as fast as possible
-    uint64_t rand_seed = std::rand();
+    // it to be as fast as possible.  xorshift gets stuck on 0
+    uint64_t rand_seed = rng() | 1;
 
     bool found_solution = false;
-    while (!found_solution) {
+    for (bool first = true; !found_solution; first = false) {
+        if (!first) {
+            retries++;
+        }
         for (int i = 0; i < rows_count; i++) {
             // random data:  j=1 ensures we dont overwrite truth table
             for (int j = 1; j < vars_count; j++) {
@@ -96,13 +245,187 @@ llvm::Value *GenerateRandomMBAIdentity(llvm::IRBuilder<> &builder, llvm::Type *t
         }
     }
 
+    MBAIdentity identity{};
+    for (int i = 0; i < vars_count; i++) {
+        identity.solution[i] = solutions[i];
+        for (int j = 0; j < rows_count; j++) {
+            identity.columns[i] |= F[j][i] << j;
+        }
+    }
+    return identity;
+}
+
+static MBATerms TermsFromIdentity(const MBAIdentity &identity, const int vars_count) {
+    MBATerms terms;
+    for (int i = 0; i < vars_count; i++) {
+        terms.push_back({identity.columns[i], identity.solution[i], llvm::None});
+    }
+    return terms;
+}
+
+// pick count distinct values from values (partial Fisher-Yates shuffle)
+template <typename T>
+static void ShufflePrefix(obfus::Random &rng, T *values, const int values_count, const int count) {
+    for (int i = 0; i < count; i++) {
+        std::swap(values[i], values[i + rng.Uniform(values_count - i)]);
+    }
+}
+
+// var k is bit vars_count - k - 1 of the row, as in the minterms
+static bool VarInRow(const int vars_count, const int row, const int k) {
+    return (row >> (vars_count - k - 1)) & 1;
+}
+
+static bool EvaluateOperation(const MBAOperation &operation, const int vars_count, const int row) {
+    const bool x = VarInRow(vars_count, row, operation.x) != operation.not_x;
+    if (operation.y < 0) {
+        return x;
+    }
+    const bool y = VarInRow(vars_count, row, operation.y) != operation.not_y;
+    bool result = false;
+    switch (operation.opcode) {
+        case llvm::Instruction::And:
+            result = x && y;
+            break;
+        case llvm::Instruction::Or:
+            result = x || y;
+            break;
+        default:
+            result = x != y;
+            break;
+    }
+    return result != operation.not_result;
+}
+
+// a random bitwise term over the variables x and y
+static MBAOperation RandomOperation(obfus::Random &rng, const int x, const int y) {
+    static const llvm::Instruction::BinaryOps kOpcodes[] = {llvm::Instruction::And, llvm::Instruction::Or, llvm::Instruction::Xor};
+    // one in four terms is a single (possibly negated) variable
+    if (rng.Uniform(4) == 0) {
+        return {llvm::Instruction::And, (rng.Uniform(2) == 0) ? x : y, -1, rng.Uniform(2) == 0, false, false};
+    }
+    return {kOpcodes[rng.Uniform(3)], x, y, rng.Uniform(2) == 0, rng.Uniform(2) == 0, rng.Uniform(2) == 0};
+}
+
+/*
+F is the 2**vars_count x m truth table matrix of m distinct random bitwise
+terms, each an operator on two neighbours of a random path through the
+variables (or one of them alone).  As integer functions of the variable bits
+those all lie in the span of 1, the variables and the products of neighbours,
+2 * vars_count dimensions, so 2 * vars_count + 1 columns always have a
+nullspace and the loop ends.  kSolverEdgeTerms columns per edge come first,
+then one column at a time until a random small combination of the basis uses
+every variable.
+*/
+static MBATerms SolveIdentity(obfus::Random &rng, const int vars_count) {
+    const int rows_count = 1 << vars_count;
+    const int edges_count = vars_count - 1;
+    const int max_terms = 3 * vars_count;
+
+    int path[kMaxVars];
+    std::iota(path, path + vars_count, 0);
+    ShufflePrefix(rng, path, vars_count, vars_count);
+
+    MBATerms terms;
+    for (;;) {
+        const int placed = terms.size();
+        const int edge = (placed < edges_count * kSolverEdgeTerms) ? placed % edges_count : static_cast<int>(rng.Uniform(edges_count));
+        MBATerm term{{}, 0, RandomOperation(rng, path[edge], path[edge + 1])};
+        for (int row = 0; row < rows_count; row++) {
+            term.rows[row] = EvaluateOperation(*term.operation, vars_count, row);
+        }
+        // the same column twice is a pair the optimizer cancels for free
+        if (std::any_of(terms.begin(), terms.end(), [&](const MBATerm &other) { return other.rows == term.rows; })) {
+            continue;
+        }
+        terms.push_back(term);
+        if (placed + 1 < edges_count * kSolverEdgeTerms) {
+            continue;
+        }
+
+        // most of the 2**vars_count rows repeat, so only the distinct ones go to the solver
+        std::bitset<kMaxTerms> patterns[kMaxRows];
+        for (int j = 0; j < rows_count; j++) {
+            patterns[j].reset();
+            for (size_t i = 0; i < terms.size(); i++) {
+                patterns[j][i] = terms[i].rows[j];
+            }
+        }
+        std::sort(patterns, patterns + rows_count, [](const std::bitset<kMaxTerms> &a, const std::bitset<kMaxTerms> &b) { return a.to_ulong() < b.to_ulong(); });
+        std::vector<std::vector<int64_t>> F;
+        for (int j = 0; j < rows_count; j++) {
+            if (patterns[j].none() || (j > 0 && patterns[j] == patterns[j - 1])) {
+                continue;
+            }
+            F.emplace_back(terms.size(), 0);
+            for (size_t i = 0; i < terms.size(); i++) {
+                F.back()[i] = patterns[j][i];
+            }
+        }
+        const auto basis = obfus::IntegerNullspace(std::move(F));
+        if (basis.empty()) {
+            continue;
+        }
+        bool nonzero = false;
+        for (auto &term : terms) {
+            term.coefficient = 0;
+        }
+        for (const auto &vector : basis) {
+            const int magnitude = 1 + static_cast<int>(rng.Uniform(kSolverMaxMultiplier));
+            const int multiplier = (rng.Uniform(2) == 0) ? magnitude : -magnitude;
+            for (size_t i = 0; i < terms.size(); i++) {
+                terms[i].coefficient += multiplier * vector[i];
+                nonzero |= terms[i].coefficient != 0;
+            }
+        }
+        // the multiples cancelled out
+        if (!nonzero) {
+            for (size_t i = 0; i < terms.size(); i++) {
+                terms[i].coefficient = basis.front()[i];
+            }
+        }
+
+        std::bitset<kMaxVars> used;
+        for (const auto &term : terms) {
+            if (term.coefficient != 0) {
+                used.set(term.operation->x);
+                if (term.operation->y >= 0) {
+                    used.set(term.operation->y);
+                }
+            }
+        }
+        if (static_cast<int>(used.count()) == vars_count || static_cast<int>(terms.size()) == max_terms) {
+            return terms;
+        }
+    }
+}
+
+static llvm::Value *LowerOperation(obfus::MBABuilder &builder, const std::vector<llvm::Value *> &vars, const MBAOperation &operation) {
+    const auto x = (operation.not_x) ? builder.CreateNot(vars[operation.x]) : vars[operation.x];
+    if (operation.y < 0) {
+        return x;
+    }
+    const auto y = (operation.not_y) ? builder.CreateNot(vars[operation.y]) : vars[operation.y];
+    const auto result = builder.CreateBinOp(operation.opcode, x, y);
+    return (operation.not_result) ? builder.CreateNot(result) : result;
+}
+
+// original lowering: sum of products as left leaning chains
+static llvm::Value *LowerChain(obfus::MBABuilder &builder, llvm::Type *type, const MBATerms &terms, const std::vector<llvm::Value *> &vars) {
+    const int vars_count = vars.size();
+    const int rows_count = 1 << vars_count;  // 2**vars_count rows
+
     llvm::Value *start = nullptr;
     // columns
-    for (int i = 0; i < vars_count; i++) {
-        llvm::Value *col_form = nullptr;
+    for (const auto &term : terms) {
+        // a column that does not contribute would only be dead IR
+        if (term.coefficient == 0) {
+            continue;
+        }
+        llvm::Value *col_form = (term.operation) ? LowerOperation(builder, vars, *term.operation) : nullptr;
         // rows
-        for (int j = 0; j < rows_count; j++) {
-            if (F[j][i] == 1) {
+        for (int j = 0; j < rows_count && !term.operation; j++) {
+            if (term.rows[j]) {
                 llvm::Value *row_expr = nullptr;
 
                 // convert to SOP form
@@ -120,14 +443,14 @@ llvm::Value *GenerateRandomMBAIdentity(llvm::IRBuilder<> &builder, llvm::Type *t
             }
         }
 
-        const int scalar = solutions[i];
+        const int64_t scalar = term.coefficient;
         // if we get a result for this column
         if (col_form) {
-            const auto res = (!start) ? builder.CreateMul(col_form, llvm::ConstantInt::get(type, scalar)) : col_form;
-
             if (!start) {
-                start = res;
+                start = builder.CreateMul(col_form, llvm::ConstantInt::get(type, scalar, true));
             } else {
+                // only multiply when the coefficient is not +-1
+                const auto res = (std::abs(scalar) == 1) ? col_form : builder.CreateMul(col_form, llvm::ConstantInt::get(type, std::abs(scalar)));
                 if (scalar > 0) {
                     start = builder.CreateAdd(start, res);
                 } else {
@@ -138,4 +461,98 @@ llvm::Value *GenerateRandomMBAIdentity(llvm::IRBuilder<> &builder, llvm::Type *t
     }
     return start;
 }
+
+// the minterm of row: var k is negated where bit vars_count - k - 1 of row
+// is clear
+static llvm::Value *LowerMinterm(obfus::MBABuilder &builder, const std::vector<llvm::Value *> &vars, const int row, const bool and_not) {
+    const int vars_count = vars.size();
+    llvm::SmallVector<llvm::Value *, kMaxVars> literals, negated;
+    for (int k = 0; k < vars_count; k++) {
+        (((row >> (vars_count - k - 1)) & 1) ? literals : negated).push_back(vars[k]);
+    }
+    if (and_not && !negated.empty()) {
+        // ~a & ~b & c & d = ~(a | b) & (c & d), the NOT folds into an and-not
+        const auto none = builder.CreateNot(builder.CreateReduction(llvm::Instruction::Or, negated));
+        return (literals.empty()) ? none : builder.CreateAnd(none, builder.CreateReduction(llvm::Instruction::And, literals));
+    }
+    for (const auto var : negated) {
+        literals.push_back(builder.CreateNot(var));
+    }
+    return builder.CreateReduction(llvm::Instruction::And, literals);
+}
+
+// the same sum of products with the critical path in mind, see MBAShape
+static llvm::Value *LowerBalanced(obfus::MBABuilder &builder, llvm::Type *type, const MBATerms &terms, const std::vector<llvm::Value *> &vars) {
+    const int vars_count = vars.size();
+    const int rows_count = 1 << vars_count;
+    const auto &shape = builder.Shape();
+    const bool ternary_logic = vars_count == 3 && shape.TernaryLogic(type) != llvm::Intrinsic::not_intrinsic;
+
+    llvm::SmallVector<llvm::Value *, kMaxTerms> positive, negative;
+    for (const auto &term : terms) {
+        if (term.coefficient == 0 || term.rows.none()) {
+            continue;
+        }
+        llvm::Value *column = nullptr;
+        if (ternary_logic) {
+            // the column over 3 variables is a truth table of 8 rows
+            column = builder.CreateTernaryLogic(vars[0], vars[1], vars[2], static_cast<uint8_t>(term.rows.to_ulong()));
+        } else if (term.operation) {
+            column = LowerOperation(builder, vars, *term.operation);
+        } else {
+            llvm::SmallVector<llvm::Value *, kMaxTableRows> minterms;
+            for (int j = 0; j < rows_count; j++) {
+                if (term.rows[j]) {
+                    minterms.push_back(LowerMinterm(builder, vars, j, shape.AndNot(type)));
+                }
+            }
+            column = builder.CreateReduction(llvm::Instruction::Or, minterms);
+        }
+        const int64_t magnitude = std::abs(term.coefficient);
+        if (magnitude != 1) {
+            column = builder.CreateMul(column, llvm::ConstantInt::get(type, magnitude));
+        }
+        ((term.coefficient > 0) ? positive : negative).push_back(column);
+    }
+
+    if (negative.empty()) {
+        return (positive.empty()) ? nullptr : builder.CreateReduction(llvm::Instruction::Add, positive);
+    }
+    const auto subtrahend = builder.CreateReduction(llvm::Instruction::Add, negative);
+    const auto minuend = (positive.empty()) ? llvm::ConstantInt::get(type, 0) : builder.CreateReduction(llvm::Instruction::Add, positive);
+    return builder.CreateSub(minuend, subtrahend);
+}
+
+namespace obfus {
+
+// generate expressions that equal 0 regardless of the value of the variables
+// pointers in vars should not be null
+// subterms are shared with earlier identities built through the same builder
+// provide between 2 and kMaxVars variables
+// type can be an integer vector type, coefficients become splats and every
+// operator works lane-wise
+// the builder's MBAShape decides how the identity is lowered to IR
+llvm::Value *GenerateRandomMBAIdentity(MBABuilder &builder, Random &rng, llvm::Type *type, const std::vector<llvm::Value *> &vars, const MBASource source, MBAStats *stats) {
+    // 5% performance improvement to be had from just assigning this
+    // to kMaxTableVars but that would assuming you always had
+    // kMaxTableVars variables.  leaving it as vars.size() for flexibility.
+    // more than kMaxTableVars variables always go through the solver
+    const int vars_count = vars.size();
+
+    uint64_t retries = 0;
+    MBATerms terms;
+    if (source == MBASource::kSolver || vars_count > kMaxTableVars) {
+        terms = SolveIdentity(rng, vars_count);
+    } else if (source == MBASource::kTable) {
+        terms = TermsFromIdentity(PickTableIdentity(rng, vars_count), vars_count);
+    } else {
+        terms = TermsFromIdentity(SampleIdentity(rng, vars_count, retries), vars_count);
+    }
+    if (stats) {
+        stats->identities++;
+        stats->retries += retries;
+    }
+
+    return (builder.Shape().balanced) ? LowerBalanced(builder, type, terms, vars) : LowerChain(builder, type, terms, vars);
+}
 }  // namespace obfus
\ No newline at end of file
@@ -7,8 +7,32 @@
 
 #include <cstdint>
 
+#include "MBABuilder.hpp"
+#include "Random.hpp"
+
 namespace obfus {
-llvm::Value *GenerateRandomMBAIdentity(llvm::IRBuilder<> &builder, llvm::Type *type, const std::vector<llvm::Value *> &vars);
-}
+// GenerateRandomMBAIdentity takes 2 to kMaxMBAVars variables
+static const constexpr int kMaxMBAVars = 8;
+
+// where the (truth table, nullspace solution) pair behind an identity comes from
+enum class MBASource {
+    // draw uniformly from tables of every valid pair built at compile time
+    kTable,
+    // original approach: random truth tables until the bruteforce finds a solution
+    kRejectionSampling,
+    // integer nullspace solver, arbitrary small coefficients
+    // always used for more than 3 variables
+    kSolver,
+};
+
+// running totals for whoever wants to report them
+struct MBAStats {
+    uint64_t identities = 0;
+    // truth tables thrown away by kRejectionSampling
+    uint64_t retries = 0;
+};
+
+llvm::Value *GenerateRandomMBAIdentity(MBABuilder &builder, Random &rng, llvm::Type *type, const std::vector<llvm::Value *> &vars, MBASource source = MBASource::kTable, MBAStats *stats = nullptr);
+}  // namespace obfus
 
 #endif
\ No newline at end of file
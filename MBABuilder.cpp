@@ -0,0 +1,120 @@
+#include "MBABuilder.hpp"
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/IntrinsicsX86.h>
+#include <llvm/IR/Module.h>
+
+// features is a target-features attribute, "+bmi,+sse2,-avx512f,..."
+static bool HasFeature(const llvm::StringRef features, const llvm::StringRef feature) {
+    llvm::SmallVector<llvm::StringRef, 64> list;
+    features.split(list, ',');
+    return llvm::is_contained(list, ("+" + feature).str());
+}
+
+namespace obfus {
+llvm::Intrinsic::ID MBAShape::TernaryLogic(const llvm::Type *type) const {
+    const auto vector = llvm::dyn_cast<llvm::FixedVectorType>(type);
+    if (!vector || !vector->getElementType()->isIntegerTy()) {
+        return llvm::Intrinsic::not_intrinsic;
+    }
+    const unsigned lane_bits = vector->getElementType()->getIntegerBitWidth();
+    const unsigned bits = lane_bits * vector->getNumElements();
+    if (lane_bits != 32 && lane_bits != 64) {
+        return llvm::Intrinsic::not_intrinsic;
+    }
+    const bool dwords = lane_bits == 32;
+    if (bits == 512 && ternary_logic_512) {
+        return (dwords) ? llvm::Intrinsic::x86_avx512_pternlog_d_512 : llvm::Intrinsic::x86_avx512_pternlog_q_512;
+    }
+    if (bits == 256 && ternary_logic_256) {
+        return (dwords) ? llvm::Intrinsic::x86_avx512_pternlog_d_256 : llvm::Intrinsic::x86_avx512_pternlog_q_256;
+    }
+    if (bits == 128 && ternary_logic_256) {
+        return (dwords) ? llvm::Intrinsic::x86_avx512_pternlog_d_128 : llvm::Intrinsic::x86_avx512_pternlog_q_128;
+    }
+    return llvm::Intrinsic::not_intrinsic;
+}
+
+MBAShape TargetMBAShape(const llvm::TargetTransformInfo &TTI, const llvm::Function &F) {
+    MBAShape shape;
+    shape.balanced = true;
+    const llvm::Triple triple(F.getParent()->getTargetTriple());
+    const auto features = F.getFnAttribute("target-features").getValueAsString();
+    if (triple.isX86()) {
+        // pandn is SSE2
+        shape.and_not_vector = true;
+        // zmm only where 512 bit vectors stay legal, not when the subtarget
+        // splits them for prefer-vector-width=256
+        const bool avx512 = HasFeature(features, "avx512f");
+        shape.ternary_logic_512 = avx512 && TTI.isTypeLegal(llvm::FixedVectorType::get(llvm::Type::getInt32Ty(F.getContext()), 16));
+        shape.ternary_logic_256 = avx512 && HasFeature(features, "avx512vl");
+    } else if (triple.isAArch64() || triple.isARM() || triple.isThumb()) {
+        // NEON bic
+        shape.and_not_vector = true;
+    }
+    return shape;
+}
+
+llvm::Value *MBABuilder::CreateBinOp(const llvm::Instruction::BinaryOps opcode, llvm::Value *x, llvm::Value *y) {
+    if (!hash_cons_) {
+        return builder_.CreateBinOp(opcode, x, y);
+    }
+
+    // x & y and y & x are the same node
+    auto key = std::make_pair(static_cast<unsigned>(opcode), std::make_pair(x, y));
+    if (llvm::Instruction::isCommutative(opcode) && y < x) {
+        std::swap(key.second.first, key.second.second);
+    }
+    const auto cached = cache_.find(key);
+    if (cached != cache_.end()) {
+        reused_++;
+        return cached->second;
+    }
+    const auto value = builder_.CreateBinOp(opcode, x, y);
+    cache_[key] = value;
+    return value;
+}
+
+llvm::Value *MBABuilder::CreateReduction(const llvm::Instruction::BinaryOps opcode, llvm::SmallVectorImpl<llvm::Value *> &values) {
+    // neighbours in pairs until one is left: depth log2(n) instead of n - 1
+    while (values.size() > 1) {
+        size_t kept = 0;
+        for (size_t i = 0; i + 1 < values.size(); i += 2) {
+            values[kept++] = CreateBinOp(opcode, values[i], values[i + 1]);
+        }
+        if (values.size() % 2 != 0) {
+            values[kept++] = values.back();
+        }
+        values.resize(kept);
+    }
+    return values.front();
+}
+
+llvm::Value *MBABuilder::CreateTernaryLogic(llvm::Value *x, llvm::Value *y, llvm::Value *z, const uint8_t truth_table) {
+    const auto build = [&]() -> llvm::Value * {
+        return builder_.CreateIntrinsic(shape_.TernaryLogic(x->getType()), {}, {x, y, z, builder_.getInt32(truth_table)});
+    };
+    if (!hash_cons_) {
+        return build();
+    }
+    const auto key = std::make_pair(std::make_pair(static_cast<unsigned>(truth_table), x), std::make_pair(y, z));
+    const auto cached = ternary_cache_.find(key);
+    if (cached != ternary_cache_.end()) {
+        reused_++;
+        return cached->second;
+    }
+    const auto value = build();
+    ternary_cache_[key] = value;
+    return value;
+}
+
+llvm::Value *MBABuilder::CreateNot(llvm::Value *x) {
+    // same node IRBuilder::CreateNot would build
+    return CreateBinOp(llvm::Instruction::Xor, x, llvm::Constant::getAllOnesValue(x->getType()));
+}
+}  // namespace obfus
@@ -0,0 +1,112 @@
+#ifndef MBA_BUILDER_HPP
+#define MBA_BUILDER_HPP
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Value.h>
+
+#include <cstdint>
+#include <utility>
+
+namespace obfus {
+// how identities are lowered to IR.  the default is the original sum of
+// products: left leaning chains of minterms and terms, the first term
+// multiplied by its coefficient even when that is +-1
+struct MBAShape {
+    // minterm ANDs, column ORs and the sum as balanced trees, positive and
+    // negative terms summed apart and subtracted once, no mul by +-1
+    bool balanced = false;
+    // the negated literals of a vector minterm become one NOT of their OR,
+    // which the target folds into an and-not (SSE pandn, NEON bic).  scalar
+    // ISel already gets andn/bic out of the shared NOTs, De Morgan there only
+    // adds instructions (bench/mba_bench)
+    bool and_not_vector = false;
+    // 3 variable columns of 32/64 bit lane vectors become one AVX-512
+    // vpternlog with the column's truth table as immediate
+    bool ternary_logic_256 = false;
+    bool ternary_logic_512 = false;
+
+    bool AndNot(const llvm::Type *type) const {
+        return type->isVectorTy() && and_not_vector;
+    }
+    // vpternlog intrinsic for type, not_intrinsic when there is none
+    llvm::Intrinsic::ID TernaryLogic(const llvm::Type *type) const;
+};
+
+// balanced shape plus whatever F's subtarget (target-features) and TTI's
+// legal vector types allow
+MBAShape TargetMBAShape(const llvm::TargetTransformInfo &TTI, const llvm::Function &F);
+
+/*
+Hash-consing front end to an IRBuilder for MBA expressions.  Binary operators
+are keyed on (opcode, operands) and only built the first time, so the NOTs of
+the variables, minterms and whole columns that several identities have in
+common are emitted once per block instead of once per use.
+Reusing a value is only valid if it dominates the insertion point, which
+holds as long as the insertion point only moves forward through a single
+block.  Call Reset before moving anywhere else.
+*/
+class MBABuilder {
+   public:
+    explicit MBABuilder(llvm::IRBuilder<> &builder, const bool hash_cons = true, const MBAShape &shape = MBAShape())
+        : builder_(builder), hash_cons_(hash_cons), shape_(shape) {}
+
+    llvm::IRBuilder<> &GetIRBuilder() {
+        return builder_;
+    }
+    const MBAShape &Shape() const {
+        return shape_;
+    }
+
+    llvm::Value *CreateBinOp(llvm::Instruction::BinaryOps opcode, llvm::Value *x, llvm::Value *y);
+    llvm::Value *CreateNot(llvm::Value *x);
+    llvm::Value *CreateAnd(llvm::Value *x, llvm::Value *y) {
+        return CreateBinOp(llvm::Instruction::And, x, y);
+    }
+    llvm::Value *CreateOr(llvm::Value *x, llvm::Value *y) {
+        return CreateBinOp(llvm::Instruction::Or, x, y);
+    }
+    llvm::Value *CreateXor(llvm::Value *x, llvm::Value *y) {
+        return CreateBinOp(llvm::Instruction::Xor, x, y);
+    }
+    llvm::Value *CreateAdd(llvm::Value *x, llvm::Value *y) {
+        return CreateBinOp(llvm::Instruction::Add, x, y);
+    }
+    llvm::Value *CreateSub(llvm::Value *x, llvm::Value *y) {
+        return CreateBinOp(llvm::Instruction::Sub, x, y);
+    }
+    llvm::Value *CreateMul(llvm::Value *x, llvm::Value *y) {
+        return CreateBinOp(llvm::Instruction::Mul, x, y);
+    }
+    // balanced tree of opcode over values, which must not be empty
+    llvm::Value *CreateReduction(llvm::Instruction::BinaryOps opcode, llvm::SmallVectorImpl<llvm::Value *> &values);
+    // bit i of the result is bit i of truth_table, indexed by x y z's bits
+    // (x the high one).  only for types Shape().TernaryLogic supports
+    llvm::Value *CreateTernaryLogic(llvm::Value *x, llvm::Value *y, llvm::Value *z, uint8_t truth_table);
+
+    void Reset() {
+        cache_.clear();
+        ternary_cache_.clear();
+    }
+    // values handed out again instead of being built
+    uint64_t Reused() const {
+        return reused_;
+    }
+
+   private:
+    using Key = std::pair<unsigned, std::pair<llvm::Value *, llvm::Value *>>;
+    using TernaryKey = std::pair<std::pair<unsigned, llvm::Value *>, std::pair<llvm::Value *, llvm::Value *>>;
+
+    llvm::IRBuilder<> &builder_;
+    const bool hash_cons_;
+    const MBAShape shape_;
+    llvm::DenseMap<Key, llvm::Value *> cache_;
+    llvm::DenseMap<TernaryKey, llvm::Value *> ternary_cache_;
+    uint64_t reused_ = 0;
+};
+}  // namespace obfus
+
+#endif
@@ -0,0 +1,110 @@
+#include "Nullspace.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <numeric>
+
+// divide a row by the gcd of its entries so fraction free elimination
+// does not blow up the coefficients
+static void NormalizeRow(std::vector<int64_t> &row) {
+    int64_t divisor = 0;
+    for (const auto value : row) {
+        divisor = std::gcd(divisor, std::abs(value));
+    }
+    if (divisor > 1) {
+        for (auto &value : row) {
+            value /= divisor;
+        }
+    }
+}
+
+namespace obfus {
+/*
+Fraction free Gauss-Jordan elimination: to clear column c of row i using
+pivot row r we compute row_i = pivot * row_i - row_i[c] * row_r which keeps
+everything in the integers.  Identities that hold over the integers also
+hold mod 2**n so this is all MBA needs.
+Truth table matrices have lots of duplicate and all zero rows (256 rows for
+8 variables but usually only a handful of distinct ones) so those are
+dropped first, which makes the cost depend on the number of distinct rows
+rather than 2**vars.
+*/
+std::vector<std::vector<int64_t>> IntegerNullspace(std::vector<std::vector<int64_t>> F) {
+    if (F.empty()) {
+        return {};
+    }
+    const int columns_count = F.front().size();
+
+    F.erase(std::remove_if(F.begin(), F.end(),
+                           [](const std::vector<int64_t> &row) {
+                               return std::all_of(row.begin(), row.end(), [](const int64_t value) { return value == 0; });
+                           }),
+            F.end());
+    std::sort(F.begin(), F.end());
+    F.erase(std::unique(F.begin(), F.end()), F.end());
+    int rows_count = F.size();
+
+    // pivot_columns[r] = column of the pivot in row r
+    std::vector<int> pivot_columns;
+    std::vector<bool> is_pivot(columns_count, false);
+    int rank = 0;
+    for (int column = 0; column < columns_count && rank < rows_count; column++) {
+        int pivot_row = rank;
+        while (pivot_row < rows_count && F[pivot_row][column] == 0) {
+            pivot_row++;
+        }
+        if (pivot_row == rows_count) {
+            continue;
+        }
+        std::swap(F[rank], F[pivot_row]);
+
+        const int64_t pivot = F[rank][column];
+        for (int row = 0; row < rows_count; row++) {
+            const int64_t factor = F[row][column];
+            if (row == rank || factor == 0) {
+                continue;
+            }
+            for (int j = 0; j < columns_count; j++) {
+                F[row][j] = (pivot * F[row][j]) - (factor * F[rank][j]);
+            }
+            NormalizeRow(F[row]);
+        }
+
+        pivot_columns.emplace_back(column);
+        is_pivot[column] = true;
+        rank++;
+
+        // rows past the pivots that cancelled out are dependent, stop carrying them
+        for (int row = rank; row < rows_count;) {
+            if (std::all_of(F[row].begin(), F[row].end(), [](const int64_t value) { return value == 0; })) {
+                std::swap(F[row], F[rows_count - 1]);
+                rows_count--;
+            } else {
+                row++;
+            }
+        }
+    }
+
+    // every row r now reads pivot_r * x[pivot_columns[r]] + sum(F[r][free] * x[free]) = 0
+    // so each free column gives one basis vector
+    int64_t pivot_lcm = 1;
+    for (int row = 0; row < rank; row++) {
+        pivot_lcm = std::lcm(pivot_lcm, std::abs(F[row][pivot_columns[row]]));
+    }
+
+    std::vector<std::vector<int64_t>> basis;
+    for (int free_column = 0; free_column < columns_count; free_column++) {
+        if (is_pivot[free_column]) {
+            continue;
+        }
+        std::vector<int64_t> vector(columns_count, 0);
+        vector[free_column] = pivot_lcm;
+        for (int row = 0; row < rank; row++) {
+            vector[pivot_columns[row]] = -F[row][free_column] * (pivot_lcm / F[row][pivot_columns[row]]);
+        }
+        NormalizeRow(vector);
+        basis.emplace_back(std::move(vector));
+    }
+    return basis;
+}
+}  // namespace obfus
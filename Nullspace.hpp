@@ -0,0 +1,14 @@
+#ifndef NULLSPACE_HPP
+#define NULLSPACE_HPP
+
+#include <cstdint>
+#include <vector>
+
+namespace obfus {
+// returns an integer basis for {v : F * v = 0}
+// F is row major and every row must have the same number of columns
+// each basis vector is scaled so its entries have no common factor
+std::vector<std::vector<int64_t>> IntegerNullspace(std::vector<std::vector<int64_t>> F);
+}  // namespace obfus
+
+#endif
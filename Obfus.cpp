@@ -1,45 +1,393 @@
 #include "Obfus.hpp"
 
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Analysis/BlockFrequencyInfo.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/IR/PassTimingInfo.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
-#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "Cache.hpp"
+#include "CostBudget.hpp"
 #include "DeriveZeroMBA.hpp"
+#include "Selection.hpp"
 #include "Transforms.hpp"
 
+#define DEBUG_TYPE "obfus"
+
+// -stats (needs an LLVM built with statistics) and -time-passes
+STATISTIC(NumFunctions, "Number of functions obfuscated");
+STATISTIC(NumFlattenedFunctions, "Number of functions flattened");
+STATISTIC(NumFlattenedBlocks, "Number of blocks moved behind a dispatcher");
+STATISTIC(NumBinaryOperators, "Number of binary operators rewritten with MBA");
+STATISTIC(NumConstants, "Number of integer constants obfuscated");
+STATISTIC(NumIdentities, "Number of MBA identities generated");
+STATISTIC(NumRetries, "Number of MBA truth tables rejected");
+STATISTIC(NumInstructionsBefore, "Number of instructions before obfuscation");
+STATISTIC(NumInstructionsAfter, "Number of instructions after obfuscation");
+STATISTIC(NumErased, "Number of replaced or dead instructions erased");
+STATISTIC(NumCacheHits, "Number of functions restored from the obfuscation cache");
+STATISTIC(NumCacheMisses, "Number of cacheable functions obfuscated from scratch");
+STATISTIC(NumUncacheable, "Number of functions the obfuscation cache cannot hold");
+
+static const char *const kTimerGroup = "obfus";
+static const char *const kTimerGroupDescription = "Obfus transforms";
+
+static llvm::cl::opt<obfus::FlattenMode> kFlattenMode(
+    "obfus-flatten-mode", llvm::cl::desc("How flattened functions carry values across the dispatcher"),
+    llvm::cl::values(clEnumValN(obfus::FlattenMode::kSSA, "ssa", "phis in the dispatcher block (default)"),
+                     clEnumValN(obfus::FlattenMode::kReg2Mem, "reg2mem", "state and values demoted to the stack"),
+                     clEnumValN(obfus::FlattenMode::kIndirectBr, "indirectbr", "threaded dispatch through a blockaddress table"),
+                     clEnumValN(obfus::FlattenMode::kLoops, "loops", "a dispatcher per loop nest level, innermost loops kept")),
+    llvm::cl::init(obfus::FlattenMode::kSSA));
+
+/*
+How identities are lowered.  chain is the original sum of products, the
+other two keep the identities but shorten their critical path: balanced
+trees everywhere and no mul by +-1, and for target also and-not friendly
+minterms and AVX-512 vpternlog columns where the subtarget has them.
+*/
+enum class MBAShapeMode {
+    kChain,
+    kBalanced,
+    kTarget,
+};
+static llvm::cl::opt<MBAShapeMode> kMBAShape(
+    "obfus-mba-shape", llvm::cl::desc("How MBA identities are lowered to IR"),
+    llvm::cl::values(clEnumValN(MBAShapeMode::kChain, "chain", "left leaning sum of products"),
+                     clEnumValN(MBAShapeMode::kBalanced, "balanced", "balanced trees, no mul by +-1"),
+                     clEnumValN(MBAShapeMode::kTarget, "target", "balanced plus and-not and vpternlog where the target has them (default)")),
+    llvm::cl::init(MBAShapeMode::kTarget));
+
+static obfus::MBAShape GetMBAShape(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
+    obfus::MBAShape shape;
+    switch (kMBAShape) {
+        case MBAShapeMode::kChain:
+            break;
+        case MBAShapeMode::kBalanced:
+            shape.balanced = true;
+            break;
+        case MBAShapeMode::kTarget:
+            shape = obfus::TargetMBAShape(FAM.getResult<llvm::TargetIRAnalysis>(F), F);
+            break;
+    }
+    return shape;
+}
+
+// functions can pick their own mode with "obfus-flatten-mode"="<mode>"
+static obfus::FlattenMode GetFlattenMode(const llvm::Function &F, const obfus::FlattenMode default_mode) {
+    if (!F.hasFnAttribute("obfus-flatten-mode")) {
+        return default_mode;
+    }
+    const auto value = F.getFnAttribute("obfus-flatten-mode").getValueAsString();
+    return llvm::StringSwitch<obfus::FlattenMode>(value)
+        .Case("ssa", obfus::FlattenMode::kSSA)
+        .Case("reg2mem", obfus::FlattenMode::kReg2Mem)
+        .Case("indirectbr", obfus::FlattenMode::kIndirectBr)
+        .Case("loops", obfus::FlattenMode::kLoops)
+        .Default(default_mode);
+}
+
+/*
+Profile guided intensity.  Blocks that are hot get -obfus-hot-mba-depth
+instead of full strength MBA and functions containing them are not
+flattened, so the cost lands on cold code.  With a profile (e.g. from
+-fprofile-instr-use) hotness comes from ProfileSummaryInfo, which has to be
+cached at module level already (the plugin's clang callback requires it, with
+opt add require<profile-summary>).  Without one a static estimate can be
+enabled with -obfus-static-hot-ratio.
+*/
+static llvm::cl::opt<bool> kProfileGuided(
+    "obfus-profile-guided", llvm::cl::desc("Use profile data to go easy on hot blocks"),
+    llvm::cl::init(true));
+static llvm::cl::opt<int> kHotPercentile(
+    "obfus-hot-percentile", llvm::cl::desc("Blocks in this percentile of the profile (parts per million) count as hot"),
+    llvm::cl::init(990000));
+static llvm::cl::opt<unsigned> kStaticHotRatio(
+    "obfus-static-hot-ratio", llvm::cl::desc("Without a profile, innermost loop blocks estimated to run this many times per call count as hot (0 = off)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<int> kHotMBADepth(
+    "obfus-hot-mba-depth", llvm::cl::desc("Operands per binary operator rewritten in hot blocks (0 skips hot blocks entirely)"),
+    llvm::cl::init(0));
+
+static llvm::SmallPtrSet<const llvm::BasicBlock *, 16> FindHotBlocks(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
+    llvm::SmallPtrSet<const llvm::BasicBlock *, 16> hot_blocks;
+    if (!kProfileGuided) {
+        return hot_blocks;
+    }
+
+    const auto &module_proxy = FAM.getResult<llvm::ModuleAnalysisManagerFunctionProxy>(F);
+    const auto PSI = module_proxy.getCachedResult<llvm::ProfileSummaryAnalysis>(*F.getParent());
+    const bool has_profile = PSI && PSI->hasProfileSummary() && F.getEntryCount().hasValue();
+    if (!has_profile && kStaticHotRatio == 0) {
+        return hot_blocks;
+    }
+
+    auto &BFI = FAM.getResult<llvm::BlockFrequencyAnalysis>(F);
+    const auto &LI = FAM.getResult<llvm::LoopAnalysis>(F);
+    for (const auto &BB : F) {
+        if (has_profile) {
+            if (PSI->isHotBlockNthPercentile(kHotPercentile, &BB, &BFI)) {
+                hot_blocks.insert(&BB);
+            }
+            continue;
+        }
+        const auto loop = LI.getLoopFor(&BB);
+        if (loop && loop->getSubLoops().empty() &&
+            BFI.getBlockFreq(&BB).getFrequency() >= kStaticHotRatio * BFI.getEntryFreq()) {
+            hot_blocks.insert(&BB);
+        }
+    }
+    return hot_blocks;
+}
+
+/*
+Cost budget.  Limits the estimated cycles per call the MBA rewrites may add
+to a function, using TargetTransformInfo latencies weighted by block
+frequency.  Once a rewrite no longer fits it is downgraded and eventually
+skipped.  Flattening is not budgeted.
+*/
+static llvm::cl::opt<unsigned> kCostBudget(
+    "obfus-cost-budget", llvm::cl::desc("Estimated cycles per call the MBA rewrites may add to a function (unlimited when not given)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<unsigned> kCostBudgetPercent(
+    "obfus-cost-budget-percent", llvm::cl::desc("Estimated overhead the MBA rewrites may add, in percent of the function's own cost (unlimited when not given)"),
+    llvm::cl::init(0));
+
+// block frequencies relative to the entry block
+static llvm::DenseMap<const llvm::BasicBlock *, double> GetBlockWeights(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
+    llvm::DenseMap<const llvm::BasicBlock *, double> weights;
+    auto &BFI = FAM.getResult<llvm::BlockFrequencyAnalysis>(F);
+    const double entry = BFI.getEntryFreq();
+    for (const auto &BB : F) {
+        weights[&BB] = (entry > 0) ? BFI.getBlockFreq(&BB).getFrequency() / entry : 1.0;
+    }
+    return weights;
+}
+
+static std::unique_ptr<obfus::CostBudget> GetCostBudget(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
+    // given means limited, 0 included: no rewrite fits a budget of 0
+    if (kCostBudget.getNumOccurrences() == 0 && kCostBudgetPercent.getNumOccurrences() == 0) {
+        return nullptr;
+    }
+    const auto &TTI = FAM.getResult<llvm::TargetIRAnalysis>(F);
+    auto weights = GetBlockWeights(F, FAM);
+    double budget = (kCostBudget.getNumOccurrences() > 0) ? kCostBudget : -1;
+    if (kCostBudgetPercent.getNumOccurrences() > 0) {
+        const double relative = obfus::CostBudget::FunctionCost(TTI, F, weights) * kCostBudgetPercent / 100;
+        budget = (budget < 0) ? relative : std::min(budget, relative);
+    }
+    return std::make_unique<obfus::CostBudget>(TTI, std::move(weights), budget);
+}
+
+/*
+Incremental builds.  With -obfus-cache-dir a function whose IR, name and
+settings were obfuscated before gets the stored result back instead of being
+rebuilt, see FunctionCache.
+*/
+static llvm::cl::opt<std::string> kCacheDir(
+    "obfus-cache-dir", llvm::cl::desc("Directory of obfuscated functions reused by later builds (off when empty)"),
+    llvm::cl::init(""));
+static llvm::cl::opt<std::string> kCachePolicy(
+    "obfus-cache-policy", llvm::cl::desc("Eviction policy of -obfus-cache-dir, the syntax of --thinlto-cache-policy (e.g. 'cache_size_bytes=512m:prune_after=24h')"),
+    llvm::cl::init("cache_size_bytes=1g"));
+
+static std::shared_ptr<const obfus::FunctionCache> GetFunctionCache() {
+    if (kCacheDir.empty()) {
+        return nullptr;
+    }
+    auto policy = llvm::parseCachePruningPolicy(kCachePolicy);
+    if (!policy) {
+        llvm::report_fatal_error(policy.takeError());
+    }
+    return std::make_shared<const obfus::FunctionCache>(kCacheDir, *policy);
+}
+
+// debug info and address taken blocks, see FunctionCache
+static void EmitUncacheable(llvm::OptimizationRemarkEmitter &ORE, const llvm::Function &F, const std::string &reason) {
+    NumUncacheable++;
+    ORE.emit([&]() {
+        return llvm::OptimizationRemarkMissed(DEBUG_TYPE, "Uncacheable", &F) << "not cached, " << reason;
+    });
+}
+
+// what one run of the pass did to F, as a remark for -pass-remarks=obfus
+// and -fsave-optimization-record
+static void EmitRemark(llvm::OptimizationRemarkEmitter &ORE, const llvm::Function &F, const obfus::TransformStats &stats,
+                       const unsigned instructions_before, const unsigned instructions_after) {
+    ORE.emit([&]() {
+        using llvm::ore::NV;
+        const float growth = (instructions_before > 0) ? static_cast<float>(instructions_after) / instructions_before : 1.0f;
+        return llvm::OptimizationRemark(DEBUG_TYPE, "Obfuscated", &F)
+               << "flattened " << NV("FlattenedBlocks", stats.flattened_blocks) << " blocks, rewrote "
+               << NV("BinaryOperators", stats.binary_operators) << " binary operators and "
+               << NV("Constants", stats.constants) << " constants with "
+               << NV("Identities", stats.mba.identities) << " identities ("
+               << NV("Retries", stats.mba.retries) << " retries), instructions "
+               << NV("InstructionsBefore", instructions_before) << " -> "
+               << NV("InstructionsAfter", instructions_after) << " (x" << NV("Growth", growth) << ", "
+               << NV("Erased", stats.erased) << " erased)";
+    });
+}
+
 namespace obfus {
-llvm::PreservedAnalyses Obfus::run(llvm::Function &F, llvm::FunctionAnalysisManager &) {
+Obfus::Obfus(const ObfusOptions &options) : options_(options), cache_(GetFunctionCache()) {}
+
+llvm::PreservedAnalyses Obfus::run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
     bool changed = false;
     const auto &name = F.getName();
+    auto &ORE = FAM.getResult<llvm::OptimizationRemarkEmitterAnalysis>(F);
 
-    if (name == "main") {
+    // nested in a function pipeline nobody may have required the selection,
+    // then only the defaults apply
+    const auto &module_proxy = FAM.getResult<llvm::ModuleAnalysisManagerFunctionProxy>(F);
+    const auto selection = module_proxy.getCachedResult<SelectionAnalysis>(*F.getParent());
+    const auto level = (selection) ? selection->Get(F) : FunctionSelection::DefaultLevel(F);
+    if (level == ObfuscationLevel::kNone) {
 #ifdef DEBUG
-        llvm::errs() << "Skipping " << name << ", blacklisted\n";
+        llvm::errs() << "Skipping " << name << ", level none\n";
 #endif
-        // skip main for now because that has our tests
+        ORE.emit([&]() {
+            return llvm::OptimizationRemarkMissed(DEBUG_TYPE, "Skipped", &F) << "obfuscation level is none";
+        });
         return llvm::PreservedAnalyses::all();
     }
+    const bool flatten = options_.flatten && level == ObfuscationLevel::kFull;
+    const int mba_depth = (level == ObfuscationLevel::kFull) ? options_.mba_depth : std::min(options_.mba_depth, 1);
+    const bool constants = options_.constants.getValueOr(mba_depth > 0);
 
 #ifdef DEBUG
     llvm::errs() << "Attempting " << name << "\n";
 #endif
 
-    changed |= obfus::TransformFlatten(F);
-    for (auto &BB : F) {
-        // ORIGINAL ORDER:
-        // changed |= obfus::TransformBinaryOperatorBasicBlock(BB);
-        // changed |= obfus::TransformIntegerConstants(BB);
-        // changed |= obfus::TransformFlatten(BB);
-        // NEW ORDER:
-        changed |= obfus::TransformBinaryOperatorBasicBlock(BB);
-        changed |= obfus::TransformIntegerConstants(BB);
+    // computed up front: flattening changes the CFG the analyses describe but
+    // keeps the original blocks, so the set stays meaningful afterwards
+    const auto hot_blocks = FindHotBlocks(F, FAM);
+#ifdef DEBUG
+    llvm::errs() << "Hot blocks: " << hot_blocks.size() << "/" << F.size() << "\n";
+#endif
+
+    // also before flattening, for the same reason.  flattening weighs the
+    // blocks it adds
+    const auto budget = GetCostBudget(F, FAM);
+
+    // what the result depends on besides the IR, for the cache key
+    const auto flatten_mode = GetFlattenMode(F, options_.flatten_mode);
+    const auto shape = GetMBAShape(F, FAM);
+    std::string cache_key;
+    if (cache_) {
+        llvm::NamedRegionTimer timer("cache-key", "Cache key", kTimerGroup, kTimerGroupDescription, llvm::TimePassesIsEnabled);
+        std::string config;
+        llvm::raw_string_ostream stream(config);
+        stream << name << " seed=" << options_.seed << " level=" << static_cast<int>(level) << " flatten=" << flatten
+               << " mode=" << static_cast<int>(flatten_mode) << " mba=" << mba_depth << " vars=" << options_.mba_vars << " constants=" << constants << " hot_mba=" << kHotMBADepth << " shape=" << static_cast<int>(kMBAShape.getValue())
+               << " budget=" << ((budget) ? budget->Budget() : 0.0) << " hot=";
+        unsigned index = 0;
+        for (const auto &BB : F) {
+            if (hot_blocks.count(&BB)) {
+                stream << index << ",";
+            }
+            index++;
+        }
+        std::string reason;
+        cache_key = FunctionCache::Key(F, stream.str(), reason);
+        if (cache_key.empty()) {
+            EmitUncacheable(ORE, F, reason);
+        }
+    }
+    if (!cache_key.empty()) {
+        llvm::NamedRegionTimer timer("cache-restore", "Cache restore", kTimerGroup, kTimerGroupDescription, llvm::TimePassesIsEnabled);
+        if (cache_->Restore(cache_key, F)) {
+            NumCacheHits++;
+            ORE.emit([&]() {
+                return llvm::OptimizationRemark(DEBUG_TYPE, "CacheHit", &F) << "restored from the obfuscation cache";
+            });
+            return llvm::PreservedAnalyses::none();
+        }
+        NumCacheMisses++;
+    }
+
+    const unsigned instructions_before = F.getInstructionCount();
+    TransformStats stats;
+    auto rng = Random::ForFunction(options_.seed, name);
+    if (flatten && hot_blocks.empty()) {
+        llvm::NamedRegionTimer timer("flatten", "Control flow flattening", kTimerGroup, kTimerGroupDescription, llvm::TimePassesIsEnabled);
+        changed |= obfus::TransformFlatten(F, rng, flatten_mode, budget.get(), &stats);
+    }
+    if (budget) {
+        // flattening erases blocks (unreachable ones, kSSA's End) and new
+        // blocks may take their addresses
+        budget->Prune();
     }
+    // hot blocks skipped entirely keep their constants too.  the pools are
+    // new blocks, the binary operator rewrite below only sees the old ones
+    const std::vector<llvm::BasicBlock *> blocks(llvm::pointer_iterator<llvm::Function::iterator>(F.begin()), llvm::pointer_iterator<llvm::Function::iterator>(F.end()));
+    if (constants) {
+        llvm::NamedRegionTimer timer("constant-mba", "Integer constant MBA", kTimerGroup, kTimerGroupDescription, llvm::TimePassesIsEnabled);
+        changed |= obfus::TransformIntegerConstants(F, rng, budget.get(), &stats, (kHotMBADepth == 0) ? &hot_blocks : nullptr, shape,
+                                                   options_.mba_vars);
+    }
+    {
+        llvm::NamedRegionTimer timer("binop-mba", "Binary operator MBA", kTimerGroup, kTimerGroupDescription, llvm::TimePassesIsEnabled);
+        for (const auto BB : blocks) {
+            const int block_mba_depth = (hot_blocks.count(BB)) ? static_cast<int>(kHotMBADepth) : mba_depth;
+            // ORIGINAL ORDER:
+            // changed |= obfus::TransformBinaryOperatorBasicBlock(BB);
+            // changed |= obfus::TransformIntegerConstants(BB);
+            // changed |= obfus::TransformFlatten(BB);
+            // NEW ORDER: flatten, constants for the whole function, binary operators
+            changed |= obfus::TransformBinaryOperatorBasicBlock(*BB, rng, block_mba_depth, budget.get(), &stats, shape, options_.mba_vars);
+        }
+    }
+    const unsigned instructions_after = F.getInstructionCount();
+    if (changed && !cache_key.empty()) {
+        // and read back, so a cold build writes exactly what a warm one will
+        // (down to use list order) and ccache further down keeps hitting
+        llvm::NamedRegionTimer timer("cache-store", "Cache store", kTimerGroup, kTimerGroupDescription, llvm::TimePassesIsEnabled);
+        std::string reason;
+        cache_->Store(cache_key, F, reason);
+        if (reason.empty()) {
+            cache_->Restore(cache_key, F);
+        } else {
+            EmitUncacheable(ORE, F, reason);
+        }
+    }
+
+    NumFunctions++;
+    NumFlattenedFunctions += (stats.flattened_blocks > 0) ? 1 : 0;
+    NumFlattenedBlocks += stats.flattened_blocks;
+    NumBinaryOperators += stats.binary_operators;
+    NumConstants += stats.constants;
+    NumIdentities += stats.mba.identities;
+    NumRetries += stats.mba.retries;
+    NumInstructionsBefore += instructions_before;
+    NumInstructionsAfter += instructions_after;
+    NumErased += stats.erased;
+    EmitRemark(ORE, F, stats, instructions_before, instructions_after);
 #ifdef DEBUG
+    if (budget) {
+        llvm::errs() << "Cost budget: spent " << budget->Spent() << " of " << budget->Budget() << "\n";
+    }
     if (changed) {
         // llvm::verifyFunction comment:
         // "Note that this function's return value is inverted from what you would expect of a function called "verify"."
@@ -54,22 +402,165 @@ llvm::PreservedAnalyses Obfus::run(llvm::Function &F, llvm::FunctionAnalysisMana
 }
 }  // namespace obfus
 
+/*
+Pass parameters, the same syntax LLVM's own parametrized passes use:
+    opt -passes='obfus<flatten=loops;mba-depth=1;seed=42>'
+    clang -mllvm -obfus-pipeline='no-flatten;ep=optimizer-last'
+flatten[=<mode>] / no-flatten, mba-depth=<0-2>, constants / no-constants, seed=<n> and
+ep=pipeline-start|optimizer-last, which only matters to clang.  Anything not
+given keeps the command line defaults.
+*/
+static llvm::cl::opt<std::string> kPipeline(
+    "obfus-pipeline", llvm::cl::desc("Parameters of the pass clang schedules, e.g. 'flatten;mba-depth=2;ep=optimizer-last;seed=1'"),
+    llvm::cl::init(""));
+
+static llvm::Expected<obfus::ObfusOptions> ParseObfusOptions(llvm::StringRef params) {
+    obfus::ObfusOptions options;
+    options.flatten_mode = kFlattenMode;
+    const auto error = [](const llvm::Twine &message) {
+        return llvm::make_error<llvm::StringError>("obfus: " + message, llvm::inconvertibleErrorCode());
+    };
+    while (!params.empty()) {
+        llvm::StringRef param, value;
+        std::tie(param, params) = params.split(';');
+        std::tie(param, value) = param.split('=');
+        if (param == "flatten") {
+            options.flatten = true;
+            if (value.empty()) {
+                continue;
+            }
+            const auto mode = llvm::StringSwitch<llvm::Optional<obfus::FlattenMode>>(value)
+                                  .Case("ssa", obfus::FlattenMode::kSSA)
+                                  .Case("reg2mem", obfus::FlattenMode::kReg2Mem)
+                                  .Case("indirectbr", obfus::FlattenMode::kIndirectBr)
+                                  .Case("loops", obfus::FlattenMode::kLoops)
+                                  .Default(llvm::None);
+            if (!mode) {
+                return error("unknown flatten mode '" + value + "'");
+            }
+            options.flatten_mode = *mode;
+        } else if (param == "no-flatten") {
+            options.flatten = false;
+        } else if (param == "mba-depth") {
+            if (value.getAsInteger(10, options.mba_depth) || options.mba_depth < 0 || options.mba_depth > 2) {
+                return error("mba-depth must be 0, 1 or 2, got '" + value + "'");
+            }
+        } else if (param == "mba-vars") {
+            if (value.getAsInteger(10, options.mba_vars) || options.mba_vars < 2 || options.mba_vars > obfus::kMaxMBAVars) {
+                return error("mba-vars must be 2 to " + llvm::Twine(obfus::kMaxMBAVars) + ", got '" + value + "'");
+            }
+        } else if (param == "constants") {
+            options.constants = true;
+        } else if (param == "no-constants") {
+            options.constants = false;
+        } else if (param == "seed") {
+            if (value.getAsInteger(0, options.seed)) {
+                return error("invalid seed '" + value + "'");
+            }
+        } else if (param == "ep") {
+            if (value == "pipeline-start") {
+                options.ep = obfus::ExtensionPoint::kPipelineStart;
+            } else if (value == "optimizer-last") {
+                options.ep = obfus::ExtensionPoint::kOptimizerLast;
+            } else {
+                return error("unknown extension point '" + value + "'");
+            }
+        } else {
+            return error("unknown parameter '" + param + "'");
+        }
+    }
+    return options;
+}
+
+// obfus or obfus<params>, false for other names and invalid parameters
+static llvm::Optional<obfus::ObfusOptions> ParsePassName(llvm::StringRef name) {
+    if (!name.consume_front("obfus")) {
+        return llvm::None;
+    }
+    if (!name.empty() && !(name.consume_front("<") && name.consume_back(">"))) {
+        return llvm::None;
+    }
+    auto options = ParseObfusOptions(name);
+    if (!options) {
+        llvm::errs() << llvm::toString(options.takeError()) << "\n";
+        return llvm::None;
+    }
+    return *options;
+}
+
+static llvm::cl::opt<std::string> kConfig(
+    "obfus-config", llvm::cl::desc("File of '<none|light|full> <glob|re:regex>' rules selecting each function's obfuscation level"),
+    llvm::cl::init(""));
+
+// runs once every function of the module is done
+struct SortDispatchTablesPass : llvm::PassInfoMixin<SortDispatchTablesPass> {
+    llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
+        obfus::SortDispatchTables(M);
+        // only the order of globals changes
+        return llvm::PreservedAnalyses::all();
+    }
+};
+
+// the module analyses the function pass reads from the cache, then the pass
+static void AddObfusPasses(llvm::ModulePassManager &MPM, const obfus::ObfusOptions &options) {
+    MPM.addPass(llvm::RequireAnalysisPass<llvm::ProfileSummaryAnalysis, llvm::Module>());
+    MPM.addPass(llvm::RequireAnalysisPass<obfus::SelectionAnalysis, llvm::Module>());
+    MPM.addPass(createModuleToFunctionPassAdaptor(obfus::Obfus(options)));
+    MPM.addPass(SortDispatchTablesPass());
+}
+
+namespace obfus {
+bool ObfuscateModule(llvm::Module &M, const ObfusOptions &options, llvm::TargetMachine *TM) {
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::PassBuilder PB(TM);
+    PB.registerModuleAnalyses(MAM);
+    MAM.registerPass([] { return SelectionAnalysis(kConfig); });
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager MPM;
+    AddObfusPasses(MPM, options);
+    return !MPM.run(M, MAM).areAllPreserved();
+}
+}  // namespace obfus
+
 extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
     return {LLVM_PLUGIN_API_VERSION, "Obfus Pass", LLVM_VERSION_STRING,
             [](llvm::PassBuilder &PB) {
-                const constexpr int seed = 1;
-                // const int seed = std::time(nullptr);
-                srand(seed);
+                PB.registerAnalysisRegistrationCallback([](llvm::ModuleAnalysisManager &MAM) {
+                    MAM.registerPass([] { return obfus::SelectionAnalysis(kConfig); });
+                });
 
-#ifdef DEBUG
-                llvm::errs() << "Random seed: " << seed << "\n";
-#endif
-
-                // for opt command
+                // for opt command: obfus or obfus<params>.  at the top level
+                // it is a module pass that also requires the analyses, inside
+                // function(...) add require<obfus-selection> in front
+                PB.registerPipelineParsingCallback(
+                    [](llvm::StringRef Name, llvm::ModulePassManager &MPM,
+                       llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
+                        if (Name == "require<obfus-selection>") {
+                            MPM.addPass(llvm::RequireAnalysisPass<obfus::SelectionAnalysis, llvm::Module>());
+                            return true;
+                        }
+                        const auto options = ParsePassName(Name);
+                        if (!options) {
+                            return false;
+                        }
+                        AddObfusPasses(MPM, *options);
+                        return true;
+                    });
                 PB.registerPipelineParsingCallback(
                     [](llvm::StringRef Name, llvm::FunctionPassManager &FPM,
                        llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
-                        FPM.addPass(obfus::Obfus());
+                        const auto options = ParsePassName(Name);
+                        if (!options) {
+                            return false;
+                        }
+                        FPM.addPass(obfus::Obfus(*options));
                         return true;
                     });
 
@@ -78,21 +569,29 @@ extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo
                 need to use at least O1 for it to register - there is no
                 other "default" callback for clang we can get aside from
                 the optimization ones
-                there is two options - register before optimizations have run, or after.
-                running before means some of your obfuscation will probably be obfuscated
-                away.  this is useful during development to make sure you make your
-                obfuscations more rigorous.  however in production in may be desirable
-                to run obfuscations after optimizations, in which case you can uncomment
-                the registerOptimizerLastEPCallback code and comment the registerPipelineStartEPCallback
-                code
+                running before optimizations (the default) means some of the
+                obfuscation will probably be optimized away, which is useful
+                during development to make the obfuscations more rigorous.
+                in production it may be desirable to run after them with
+                -mllvm -obfus-pipeline=ep=optimizer-last
                 */
-                PB.registerPipelineStartEPCallback(
-                    [](llvm::ModulePassManager &MPM) {
-                        MPM.addPass(createModuleToFunctionPassAdaptor(obfus::Obfus()));
-                    });
-                // PB.registerOptimizerLastEPCallback(
-                //     [](llvm::ModulePassManager &MPM, llvm::PassBuilder::OptimizationLevel) {
-                //         MPM.addPass(llvm::createModuleToFunctionPassAdaptor(obfus::Obfus()));
-                //     });
+                auto options = ParseObfusOptions(kPipeline);
+                if (!options) {
+                    llvm::report_fatal_error(options.takeError());
+                }
+#ifdef DEBUG
+                llvm::errs() << "Random seed: " << options->seed << "\n";
+#endif
+                if (options->ep == obfus::ExtensionPoint::kPipelineStart) {
+                    PB.registerPipelineStartEPCallback(
+                        [options = *options](llvm::ModulePassManager &MPM) {
+                            AddObfusPasses(MPM, options);
+                        });
+                } else {
+                    PB.registerOptimizerLastEPCallback(
+                        [options = *options](llvm::ModulePassManager &MPM, llvm::PassBuilder::OptimizationLevel) {
+                            AddObfusPasses(MPM, options);
+                        });
+                }
             }};
 }
@@ -1,15 +1,65 @@
 #ifndef OBFUS_HPP
 #define OBFUS_HPP
 
+#include <llvm/ADT/Optional.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <cstdint>
+#include <memory>
+
+#include "Random.hpp"
+#include "Transforms.hpp"
 
 namespace obfus {
+// where clang schedules the pass
+enum class ExtensionPoint {
+    // before the optimizer, which then simplifies part of the obfuscation
+    // away and optimizes around the rest
+    kPipelineStart,
+    // after the optimizer, only codegen sees the obfuscated code
+    kOptimizerLast,
+};
+
+// parameters of one pass instance, from obfus<...> in an opt pipeline or
+// -obfus-pipeline for clang
+struct ObfusOptions {
+    // module seed: every function derives its own Random stream from it
+    uint64_t seed = kDefaultSeed;
+    bool flatten = true;
+    // functions can still pick their own with "obfus-flatten-mode"
+    FlattenMode flatten_mode = FlattenMode::kSSA;
+    // operands per binary operator rewritten outside of hot blocks
+    int mba_depth = 2;
+    // variables per identity (2 to kMaxMBAVars): the operands and random
+    // constants for the rest
+    int mba_vars = 3;
+    // integer constants rewritten with MBA, unset follows mba_depth > 0
+    llvm::Optional<bool> constants;
+    // only used by the clang callbacks, a pipeline string places the pass itself
+    ExtensionPoint ep = ExtensionPoint::kPipelineStart;
+};
+
+class FunctionCache;
+
 struct Obfus : llvm::PassInfoMixin<Obfus> {
    public:
+    explicit Obfus(const ObfusOptions &options = ObfusOptions());
     llvm::PreservedAnalyses run(llvm::Function &F, llvm::FunctionAnalysisManager &);
+
+   private:
+    ObfusOptions options_;
+    // -obfus-cache-dir, opened once and shared by the copies pass managers make
+    std::shared_ptr<const FunctionCache> cache_;
 };
+
+// the pass on every function defined in M without a pipeline of the caller's,
+// for embedders like the JIT layer in jit/.  TM gives the cost model, without
+// one TTI falls back to the defaults.  true if M changed
+bool ObfuscateModule(llvm::Module &M, const ObfusOptions &options, llvm::TargetMachine *TM = nullptr);
 }  // namespace obfus
 
 extern "C" LLVM_ATTRIBUTE_WEAK llvm::PassPluginLibraryInfo llvmGetPassPluginInfo();
@@ -0,0 +1,51 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/xxhash.h>
+
+#include <cstdint>
+
+namespace obfus {
+static const constexpr uint64_t kDefaultSeed = 1;
+
+/*
+Counter based generator: output n is the SplitMix64 finalizer applied to
+key + n * golden ratio, so a stream is fully described by its key and
+position and nothing is shared between streams.  Every function gets its
+own stream keyed on the module seed and a hash of its name, which makes the
+output independent of the order functions are visited in and safe to use
+from parallel (Thin)LTO backends.
+*/
+class Random {
+   public:
+    explicit Random(const uint64_t key) : key_(key) {}
+
+    static Random ForFunction(const uint64_t seed, const llvm::StringRef name) {
+        return Random(Mix(seed ^ llvm::xxHash64(name)));
+    }
+
+    uint64_t operator()() {
+        return Mix(key_ + (++counter_ * kGoldenRatio));
+    }
+
+    // value in [0, bound)
+    uint64_t Uniform(const uint64_t bound) {
+        return (*this)() % bound;
+    }
+
+   private:
+    static const constexpr uint64_t kGoldenRatio = 0x9e3779b97f4a7c15;
+
+    static uint64_t Mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t key_;
+    uint64_t counter_ = 0;
+};
+}  // namespace obfus
+
+#endif
@@ -0,0 +1,208 @@
+#include "Selection.hpp"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/GlobPattern.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Regex.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace obfus {
+struct SelectionRule {
+    ObfuscationLevel level;
+    // exactly one of them is set
+    std::unique_ptr<llvm::GlobPattern> glob;
+    std::unique_ptr<llvm::Regex> regex;
+
+    bool Matches(const llvm::StringRef name) const {
+        return (glob) ? glob->match(name) : regex->match(name);
+    }
+};
+}  // namespace obfus
+
+// malformed lines are errors rather than being skipped, a typo should not
+// quietly leave a function unprotected
+static std::vector<obfus::SelectionRule> ReadConfig(const std::string &path, llvm::LLVMContext &context) {
+    std::vector<obfus::SelectionRule> rules;
+    const auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        context.emitError("obfus: cannot read config " + path + ": " + buffer.getError().message());
+        return rules;
+    }
+    llvm::StringRef text = (*buffer)->getBuffer();
+    for (int line_number = 1; !text.empty(); line_number++) {
+        llvm::StringRef line;
+        std::tie(line, text) = text.split('\n');
+        line = line.split('#').first.trim();
+        if (line.empty()) {
+            continue;
+        }
+        const auto location = path + ":" + llvm::Twine(line_number) + ": ";
+        llvm::StringRef level_name, pattern;
+        // level and pattern split on any run of spaces and tabs
+        std::tie(level_name, pattern) = llvm::getToken(line, " \t");
+        pattern = pattern.trim();
+        const auto level = obfus::ParseObfuscationLevel(level_name);
+        if (!level || pattern.empty()) {
+            context.emitError("obfus: " + location + "expected '<none|light|full> <pattern>'");
+            continue;
+        }
+
+        obfus::SelectionRule rule{*level, nullptr, nullptr};
+        if (pattern.consume_front("re:")) {
+            rule.regex = std::make_unique<llvm::Regex>(pattern);
+            std::string error;
+            if (!rule.regex->isValid(error)) {
+                context.emitError("obfus: " + location + error);
+                continue;
+            }
+        } else {
+            auto glob = llvm::GlobPattern::create(pattern);
+            if (!glob) {
+                context.emitError("obfus: " + location + llvm::toString(glob.takeError()));
+                continue;
+            }
+            rule.glob = std::make_unique<llvm::GlobPattern>(std::move(*glob));
+        }
+        rules.emplace_back(std::move(rule));
+    }
+    return rules;
+}
+
+// entries are {function, annotation string, file, line(, arguments)}
+static void ReadAnnotations(llvm::Module &M, llvm::StringMap<obfus::ObfuscationLevel> &levels) {
+    const auto annotations = M.getNamedGlobal("llvm.global.annotations");
+    if (!annotations || !annotations->hasInitializer()) {
+        return;
+    }
+    const auto entries = llvm::dyn_cast<llvm::ConstantArray>(annotations->getInitializer());
+    if (!entries) {
+        return;
+    }
+    for (const auto &operand : entries->operands()) {
+        const auto entry = llvm::dyn_cast<llvm::ConstantStruct>(operand);
+        if (!entry || entry->getNumOperands() < 2) {
+            continue;
+        }
+        const auto F = llvm::dyn_cast<llvm::Function>(entry->getOperand(0)->stripPointerCasts());
+        const auto string = llvm::dyn_cast<llvm::GlobalVariable>(entry->getOperand(1)->stripPointerCasts());
+        if (!F || !string || !string->hasInitializer()) {
+            continue;
+        }
+        const auto data = llvm::dyn_cast<llvm::ConstantDataSequential>(string->getInitializer());
+        if (!data || !data->isCString()) {
+            continue;
+        }
+        // "obfus" alone means full
+        llvm::StringRef annotation = data->getAsCString();
+        if (!annotation.consume_front("obfus") || !(annotation.empty() || annotation.consume_front("="))) {
+            continue;
+        }
+        const auto level = (annotation.empty()) ? obfus::ObfuscationLevel::kFull : obfus::ParseObfuscationLevel(annotation);
+        if (!level) {
+            M.getContext().emitError("obfus: unknown level '" + annotation + "' on " + F->getName());
+            continue;
+        }
+        levels[F->getName()] = *level;
+    }
+}
+
+// an attribute wins over an annotation, it is either set on purpose or a
+// copy of the same annotation
+static void ReadAttributes(llvm::Module &M, llvm::StringMap<obfus::ObfuscationLevel> &levels) {
+    for (const auto &F : M) {
+        if (!F.hasFnAttribute("obfus-level")) {
+            continue;
+        }
+        const auto value = F.getFnAttribute("obfus-level").getValueAsString();
+        const auto level = obfus::ParseObfuscationLevel(value);
+        if (!level) {
+            M.getContext().emitError("obfus: unknown level '" + value + "' on " + F.getName());
+            continue;
+        }
+        levels[F.getName()] = *level;
+    }
+}
+
+namespace obfus {
+llvm::AnalysisKey SelectionAnalysis::Key;
+
+llvm::Optional<ObfuscationLevel> ParseObfuscationLevel(const llvm::StringRef name) {
+    return llvm::StringSwitch<llvm::Optional<ObfuscationLevel>>(name)
+        .Case("none", ObfuscationLevel::kNone)
+        .Case("light", ObfuscationLevel::kLight)
+        .Case("full", ObfuscationLevel::kFull)
+        .Default(llvm::None);
+}
+
+void AnnotationsToAttributes(llvm::Module &M) {
+    llvm::StringMap<ObfuscationLevel> levels;
+    ReadAnnotations(M, levels);
+    for (const auto &entry : levels) {
+        const auto F = M.getFunction(entry.getKey());
+        if (!F || F->hasFnAttribute("obfus-level")) {
+            continue;
+        }
+        switch (entry.getValue()) {
+            case ObfuscationLevel::kNone:
+                F->addFnAttr("obfus-level", "none");
+                break;
+            case ObfuscationLevel::kLight:
+                F->addFnAttr("obfus-level", "light");
+                break;
+            case ObfuscationLevel::kFull:
+                F->addFnAttr("obfus-level", "full");
+                break;
+        }
+    }
+}
+
+ObfuscationLevel FunctionSelection::Get(const llvm::Function &F) const {
+    const auto found = levels_.find(F.getName());
+    if (found != levels_.end()) {
+        return found->second;
+    }
+    return (rules_) ? Match(F.getName()) : DefaultLevel(F);
+}
+
+// first matching rule wins, unmatched functions get full
+ObfuscationLevel FunctionSelection::Match(const llvm::StringRef name) const {
+    for (const auto &rule : *rules_) {
+        if (rule.Matches(name)) {
+            return rule.level;
+        }
+    }
+    return ObfuscationLevel::kFull;
+}
+
+ObfuscationLevel FunctionSelection::DefaultLevel(const llvm::Function &F) {
+    return (F.getName() == "main") ? ObfuscationLevel::kNone : ObfuscationLevel::kFull;
+}
+
+FunctionSelection SelectionAnalysis::run(llvm::Module &M, llvm::ModuleAnalysisManager &) {
+    FunctionSelection selection;
+    ReadAnnotations(M, selection.levels_);
+    ReadAttributes(M, selection.levels_);
+    if (config_path_.empty()) {
+        return selection;
+    }
+
+    // a config replaces the defaults
+    selection.rules_ = std::make_shared<const std::vector<SelectionRule>>(ReadConfig(config_path_, M.getContext()));
+    for (const auto &F : M) {
+        if (!F.isDeclaration() && !selection.levels_.count(F.getName())) {
+            selection.levels_[F.getName()] = selection.Match(F.getName());
+        }
+    }
+    return selection;
+}
+}  // namespace obfus
@@ -0,0 +1,89 @@
+#ifndef SELECTION_HPP
+#define SELECTION_HPP
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace obfus {
+// how much of the pass a function gets
+enum class ObfuscationLevel {
+    kNone,
+    // MBA with one operand per binary operator, no flattening
+    kLight,
+    // everything the pass options ask for
+    kFull,
+};
+
+llvm::Optional<ObfuscationLevel> ParseObfuscationLevel(llvm::StringRef name);
+
+// copies the annotations to "obfus-level" function attributes.  a module
+// split in parts keeps llvm.global.annotations in only one of them, the
+// attributes travel with their functions
+void AnnotationsToAttributes(llvm::Module &M);
+
+struct SelectionRule;
+
+// level of every defined function in a module, resolved once when the
+// analysis runs and looked up by name
+class FunctionSelection {
+   public:
+    ObfuscationLevel Get(const llvm::Function &F) const;
+
+    // without a config file: main keeps our tests readable, the rest is full
+    static ObfuscationLevel DefaultLevel(const llvm::Function &F);
+
+    // like ProfileSummaryInfo this is read through the outer analysis proxy
+    // and never invalidated, functions created later are matched against
+    // the rules when they are looked up
+    bool invalidate(llvm::Module &, const llvm::PreservedAnalyses &, llvm::ModuleAnalysisManager::Invalidator &) {
+        return false;
+    }
+
+   private:
+    friend class SelectionAnalysis;
+    ObfuscationLevel Match(llvm::StringRef name) const;
+
+    llvm::StringMap<ObfuscationLevel> levels_;
+    // null without a config file
+    std::shared_ptr<const std::vector<SelectionRule>> rules_;
+};
+
+/*
+Module analysis behind FunctionSelection.  Levels come from an
+"obfus-level"="<level>" function attribute or
+__attribute__((annotate("obfus=<level>"))) (llvm.global.annotations) first,
+then from the first matching rule of the config file, then DefaultLevel.
+A config file has one "<level> <pattern>" rule per line, patterns are globs
+or "re:<regex>", # starts a comment:
+    full   crypto_*
+    light  re:^parse_[a-z]+$
+    none   *
+The function pass only reads the cached result, so it has to be required
+at module level first (the plugin does that for clang and for a top level
+-passes=obfus in opt).
+*/
+class SelectionAnalysis : public llvm::AnalysisInfoMixin<SelectionAnalysis> {
+   public:
+    using Result = FunctionSelection;
+
+    explicit SelectionAnalysis(std::string config_path = "") : config_path_(std::move(config_path)) {}
+    Result run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+
+   private:
+    friend llvm::AnalysisInfoMixin<SelectionAnalysis>;
+    static llvm::AnalysisKey Key;
+
+    std::string config_path_;
+};
+}  // namespace obfus
+
+#endif
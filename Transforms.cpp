@@ -1,22 +1,41 @@
 #include "Transforms.hpp"
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/Pass.h>
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
 
-#include "DeriveZeroMBA.hpp"
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
-static const auto kReg2MemPass = llvm::createDemoteRegisterToMemoryPass();
+#include "CostBudget.hpp"
+#include "DeriveZeroMBA.hpp"
+#include "MBABuilder.hpp"
 
 // zero_expr and x cannot be null
-static llvm::Value *GetObfuscatedValue(llvm::IRBuilder<> &builder, llvm::Value *zero_expr, llvm::Value *x) {
+static llvm::Value *GetObfuscatedValue(obfus::MBABuilder &builder, obfus::Random &rng, llvm::Value *zero_expr, llvm::Value *x) {
     // return a version of x (that is always equal to x) that has some
     // binary operator applied to it
     // zero_expr cannot be too simple or this transform will be optimized
     // out by the compiler.  zero_expr should be generated by GenerateRandomMBAIdentity
     // zero_expr must be a llvm::Value that is ALWAYS equal to zero
-    switch (std::rand() % 4) {
+    switch (rng.Uniform(4)) {
         case 0:
             // x + 0 = x
             return builder.CreateAdd(x, zero_expr);
@@ -37,31 +56,389 @@ static llvm::Value *GetObfuscatedValue(llvm::IRBuilder<> &builder, llvm::Value *
     return nullptr;
 }
 
+// binary operators TransformBinaryOperatorBasicBlock has a rewrite for
+static bool IsRewritable(const unsigned opcode) {
+    switch (opcode) {
+        case llvm::Instruction::Add:
+        case llvm::Instruction::Sub:
+        case llvm::Instruction::Xor:
+        case llvm::Instruction::Or:
+        case llvm::Instruction::And:
+            return true;
+    }
+    return false;
+}
+
+// erases I, which must be unused, and whatever that leaves trivially dead.
+// returns how many instructions went
+static uint64_t EraseDead(llvm::Instruction *I) {
+    uint64_t erased = 0;
+    llvm::SmallVector<llvm::Instruction *, 16> worklist{I};
+    while (!worklist.empty()) {
+        const auto dead = worklist.pop_back_val();
+        for (auto &operand : dead->operands()) {
+            const auto instruction = llvm::dyn_cast<llvm::Instruction>(operand.get());
+            operand.set(nullptr);
+            // pushed once, when its last use goes
+            if (instruction && llvm::isInstructionTriviallyDead(instruction)) {
+                worklist.emplace_back(instruction);
+            }
+        }
+        dead->eraseFromParent();
+        erased++;
+    }
+    return erased;
+}
+
+// integer and integer vector constants, the only constants the MBA
+// transforms hide behind identities.  vector identities are built from
+// splats and lane-wise operators so they stay vector code
+static llvm::Constant *GetIntegerConstant(llvm::Value *value) {
+    if (!value->getType()->isIntOrIntVectorTy()) {
+        return nullptr;
+    }
+    if (llvm::isa<llvm::ConstantInt>(value) || llvm::isa<llvm::ConstantDataVector>(value) ||
+        llvm::isa<llvm::ConstantVector>(value) || llvm::isa<llvm::ConstantAggregateZero>(value)) {
+        return llvm::cast<llvm::Constant>(value);
+    }
+    return nullptr;
+}
+
+// lower depth (identities per rewrite) and then vars_count until the
+// rewrite fits in the budget, false if nothing does
+static bool AffordIdentities(const obfus::CostBudget &budget, const llvm::BasicBlock &BB, int &depth, int &vars_count) {
+    const int max_vars = vars_count;
+    for (; depth > 0; depth--) {
+        for (vars_count = max_vars; vars_count >= 2; vars_count--) {
+            if (budget.CanAfford(BB, depth, vars_count)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+Flattening code gets the location of an artificial "obfus.dispatcher"
+function inlined into F, so profilers and debuggers show what the dispatch
+costs as a frame of its own instead of blaming nothing or the wrong line.
+State updates are inlined at the branch they replace, the dispatcher blocks
+at F's first line.  Functions without debug info get no locations.
+*/
+class DispatcherLocations {
+   public:
+    explicit DispatcherLocations(llvm::Function &F) : function_(F.getSubprogram()) {
+        if (!function_) {
+            return;
+        }
+        llvm::DIBuilder DIB(*F.getParent(), false, function_->getUnit());
+        const auto type = DIB.createSubroutineType(DIB.getOrCreateTypeArray({}));
+        dispatcher_ = DIB.createFunction(function_->getFile(), "obfus.dispatcher", "", function_->getFile(), function_->getLine(), type, function_->getLine(),
+                                         llvm::DINode::FlagArtificial, llvm::DISubprogram::SPFlagDefinition | llvm::DISubprogram::SPFlagLocalToUnit);
+        DIB.finalizeSubprogram(dispatcher_);
+    }
+
+    // at is where the dispatch was a branch, empty for the dispatcher itself
+    llvm::DebugLoc Get(const llvm::DebugLoc &at = llvm::DebugLoc()) const {
+        if (!dispatcher_) {
+            return llvm::DebugLoc();
+        }
+        auto &context = dispatcher_->getContext();
+        const auto inlined_at = (at) ? at.get() : llvm::DILocation::get(context, function_->getLine(), 0, function_);
+        return llvm::DILocation::get(context, dispatcher_->getLine(), 0, dispatcher_, inlined_at);
+    }
+    // what flattening left without a location, reg2mem's loads and stores
+    void Fill(llvm::Function &F) const {
+        if (!dispatcher_) {
+            return;
+        }
+        for (auto &I : llvm::instructions(F)) {
+            if (!I.getDebugLoc() && !llvm::isa<llvm::PHINode>(I) && !llvm::isa<llvm::AllocaInst>(I)) {
+                I.setDebugLoc(Get());
+            }
+        }
+    }
+
+   private:
+    llvm::DISubprogram *function_ = nullptr;
+    llvm::DISubprogram *dispatcher_ = nullptr;
+};
+
+// a flattened block that jumps back to the dispatcher with its next state
+struct Jumper {
+    llvm::BasicBlock *block;
+    llvm::Value *state;
+    llvm::SmallVector<llvm::BasicBlock *, 2> successors;
+};
+
+// kSSA gives every value live across blocks a dispatcher phi with one
+// incoming per flattened block, so its size is values * blocks.  past this
+// many phi operands the function is flattened with kReg2Mem instead
+static const constexpr uint64_t kMaxSSAPhiOperands = 1 << 20;
+
+static bool CanFlattenSSA(const llvm::Function &F) {
+    uint64_t live_count = 0;
+    for (const auto &BB : F) {
+        // indirectbr keeps its edges, which the repair below does not
+        // handle.  invokes keep theirs too but TransformFlatten promotes
+        // those functions from the stack instead
+        const auto terminator = BB.getTerminator();
+        if (terminator->getNumSuccessors() > 0 && !llvm::isa<llvm::BranchInst>(terminator) && !llvm::isa<llvm::SwitchInst>(terminator) &&
+            !llvm::isa<llvm::InvokeInst>(terminator)) {
+            return false;
+        }
+        if (&BB == &F.getEntryBlock()) {
+            continue;
+        }
+        for (const auto &I : BB) {
+            if (llvm::isa<llvm::PHINode>(I) || I.isUsedOutsideOfBlock(&BB)) {
+                live_count++;
+            }
+        }
+    }
+    return live_count * F.size() <= kMaxSSAPhiOperands;
+}
+
+/*
+kSSA flattening: after the CFG is rewritten every flattened block is entered
+from the dispatcher and leaves through it, so only first_bb and the
+dispatcher still dominate anything.  Every value used outside its block gets
+a phi in the dispatcher that takes the value from its defining block and
+keeps its previous value coming from any other block.  Every phi gets one
+that takes its incoming value only when the jumper's next state is the phi's
+block, since a block with two successors passes the dispatcher on both
+edges.  Linear in the size of the phis created.
+*/
+static void RepairSSA(llvm::BasicBlock *first_bb, llvm::BasicBlock *dispatcher, llvm::BasicBlock *sw_default,
+                      llvm::ArrayRef<llvm::BasicBlock *> original_bb, llvm::ArrayRef<Jumper> jumpers,
+                      const llvm::DenseMap<llvm::BasicBlock *, llvm::ConstantInt *> &case_values) {
+    std::vector<llvm::PHINode *> phis;
+    std::vector<llvm::Instruction *> live;
+    for (const auto BB : original_bb) {
+        for (auto &I : *BB) {
+            if (const auto PN = llvm::dyn_cast<llvm::PHINode>(&I)) {
+                phis.emplace_back(PN);
+            } else if (I.isUsedOutsideOfBlock(BB)) {
+                live.emplace_back(&I);
+            }
+        }
+    }
+
+    // placed after the state phi
+    llvm::IRBuilder<> builder(dispatcher, dispatcher->getFirstInsertionPt());
+    const unsigned incoming_count = jumpers.size() + 2;
+    llvm::DenseMap<llvm::Value *, llvm::PHINode *> repaired;
+    for (const auto PN : phis) {
+        repaired[PN] = builder.CreatePHI(PN->getType(), incoming_count, PN->getName());
+    }
+    for (const auto I : live) {
+        repaired[I] = builder.CreatePHI(I->getType(), incoming_count, I->getName());
+    }
+
+    // uses whose block no longer sees the definition read the dispatcher
+    // phi instead (phi operands count as used in their incoming block)
+    for (const auto I : live) {
+        llvm::SmallVector<llvm::Use *, 8> broken_uses;
+        for (auto &U : I->uses()) {
+            const auto user_phi = llvm::dyn_cast<llvm::PHINode>(U.getUser());
+            const auto use_block = (user_phi) ? user_phi->getIncomingBlock(U) : llvm::cast<llvm::Instruction>(U.getUser())->getParent();
+            if (use_block != I->getParent()) {
+                broken_uses.emplace_back(&U);
+            }
+        }
+        for (const auto U : broken_uses) {
+            U->set(repaired[I]);
+        }
+    }
+
+    // value of v at the end of block
+    const auto available = [&](llvm::Value *v, const llvm::BasicBlock *block) -> llvm::Value * {
+        const auto found = repaired.find(v);
+        if (found == repaired.end()) {
+            return v;
+        }
+        const bool phi = llvm::isa<llvm::PHINode>(v);
+        return (!phi && llvm::cast<llvm::Instruction>(v)->getParent() == block) ? v : found->second;
+    };
+
+    for (const auto I : live) {
+        const auto PN = repaired[I];
+        PN->addIncoming(llvm::UndefValue::get(I->getType()), first_bb);
+        PN->addIncoming(PN, sw_default);
+        for (const auto &jumper : jumpers) {
+            PN->addIncoming((jumper.block == I->getParent()) ? static_cast<llvm::Value *>(I) : PN, jumper.block);
+        }
+    }
+
+    for (const auto PN : phis) {
+        const auto new_phi = repaired[PN];
+        const auto block = PN->getParent();
+        llvm::SmallDenseMap<llvm::BasicBlock *, llvm::Value *, 4> incoming;
+        for (unsigned i = 0; i < PN->getNumIncomingValues(); i++) {
+            incoming.try_emplace(PN->getIncomingBlock(i), PN->getIncomingValue(i));
+        }
+
+        new_phi->addIncoming(llvm::UndefValue::get(PN->getType()), first_bb);
+        new_phi->addIncoming(new_phi, sw_default);
+        for (const auto &jumper : jumpers) {
+            const auto found = incoming.find(jumper.block);
+            if (found == incoming.end()) {
+                new_phi->addIncoming(new_phi, jumper.block);
+                continue;
+            }
+            auto value = available(found->second, jumper.block);
+            if (llvm::any_of(jumper.successors, [&](const llvm::BasicBlock *successor) { return successor != block; })) {
+                llvm::IRBuilder<> jumper_builder(jumper.block->getTerminator());
+                const auto taken = jumper_builder.CreateICmpEQ(jumper.state, case_values.lookup(block));
+                value = jumper_builder.CreateSelect(taken, value, new_phi);
+            }
+            new_phi->addIncoming(value, jumper.block);
+        }
+    }
+    for (const auto PN : phis) {
+        PN->replaceAllUsesWith(repaired[PN]);
+        PN->eraseFromParent();
+    }
+}
+
+// an integer constant operand of an original instruction
+struct ConstantUse {
+    llvm::Instruction *user;
+    unsigned index;
+    llvm::Constant *constant;
+    // preheader whose pool the value comes from, nullptr for the function pool
+    llvm::BasicBlock *place;
+};
+
+// a pooled constant is charged to its first user, a phi's to the branch it
+// comes in from.  line 0 (compiler generated) when neither has a location
+static llvm::DebugLoc GetUseLocation(const ConstantUse &use) {
+    const auto phi = llvm::dyn_cast<llvm::PHINode>(use.user);
+    auto location = (phi) ? phi->getIncomingBlock(use.index)->getTerminator()->getDebugLoc() : use.user->getDebugLoc();
+    const auto SP = use.user->getFunction()->getSubprogram();
+    if (!location && SP) {
+        location = llvm::DILocation::get(SP->getContext(), 0, 0, SP);
+    }
+    return location;
+}
+
+// pooled MBA versions of constants, built in a block of their own which the
+// binary operator rewrite never sees
+struct ConstantPool {
+    ConstantPool(llvm::BasicBlock *pool_block, const obfus::MBAShape &shape)
+        : block(pool_block), ir_builder(pool_block->getTerminator()), builder(ir_builder, true, shape) {}
+
+    // an argument converted to type, the identities need something the
+    // compiler cannot see through.  without one the address of a stack slot
+    // does, frozen undef would too in theory but codegen does not keep it
+    // one value across uses
+    llvm::Value *Variable(llvm::Function &F, llvm::Type *type) {
+        auto &variable = variables[type];
+        if (variable) {
+            return variable;
+        }
+        const auto scalar_type = type->getScalarType();
+        for (auto &arg : F.args()) {
+            if (arg.getType()->isIntegerTy()) {
+                variable = ir_builder.CreateZExtOrTrunc(&arg, scalar_type);
+                break;
+            }
+            if (arg.getType()->isPointerTy()) {
+                variable = ir_builder.CreatePtrToInt(&arg, scalar_type);
+                break;
+            }
+        }
+        if (!variable) {
+            llvm::IRBuilder<> entry_builder(&*F.getEntryBlock().getFirstInsertionPt());
+            variable = ir_builder.CreatePtrToInt(entry_builder.CreateAlloca(entry_builder.getInt8Ty(), nullptr, "opaque"), scalar_type);
+        }
+        if (const auto vector_type = llvm::dyn_cast<llvm::VectorType>(type)) {
+            variable = ir_builder.CreateVectorSplat(vector_type->getElementCount(), variable);
+        }
+        return variable;
+    }
+
+    llvm::BasicBlock *block;
+    llvm::IRBuilder<> ir_builder;
+    obfus::MBABuilder builder;
+    llvm::DenseMap<llvm::Type *, llvm::Value *> variables;
+    llvm::DenseMap<llvm::Constant *, llvm::Value *> values;
+};
+
+// the function pool becomes the entry block and takes over the allocas so
+// they stay static, a loop pool is split off the end of the preheader
+static llvm::BasicBlock *CreatePoolBlock(llvm::Function &F, llvm::BasicBlock *preheader) {
+    if (preheader) {
+        return preheader->splitBasicBlock(preheader->getTerminator(), "ConstantPool");
+    }
+    const auto entry = &F.getEntryBlock();
+    const auto pool_block = llvm::BasicBlock::Create(F.getContext(), "ConstantPool", &F, entry);
+    const auto branch = llvm::BranchInst::Create(entry, pool_block);
+    if (const auto SP = F.getSubprogram()) {
+        // line 0, compiler generated
+        branch->setDebugLoc(llvm::DILocation::get(F.getContext(), 0, 0, SP));
+    }
+    for (auto I = entry->begin(); I != entry->end();) {
+        auto &moved = *I++;
+        if (llvm::isa<llvm::AllocaInst>(moved)) {
+            moved.moveBefore(branch);
+        }
+    }
+    return pool_block;
+}
+
 namespace obfus {
-bool TransformBinaryOperatorBasicBlock(llvm::BasicBlock &BB) {
+bool TransformBinaryOperatorBasicBlock(llvm::BasicBlock &BB, Random &rng, const int mba_depth, CostBudget *budget, TransformStats *stats, const MBAShape &shape,
+                                       const int mba_vars) {
     bool changed = false;
+    if (mba_depth <= 0) {
+        return false;
+    }
 
+    // one cache for the whole block, the insertion point only moves forward
+    llvm::IRBuilder<> ir_builder(BB.getContext());
+    MBABuilder builder(ir_builder, true, shape);
+    const auto mba_stats = (stats) ? &stats->mba : nullptr;
+    // erased after the walk, the cache is keyed on pointers and a freed
+    // instruction's address can come back for a new one
+    std::vector<llvm::Instruction *> replaced;
     for (auto I = BB.begin(); I != BB.end(); ++I) {
-        // Skip non-binary (e.g. unary or compare) instructions
+        // Skip non-binary (e.g. unary or compare) instructions, and the
+        // ones we have no rewrite for whose identities would just be dead
         const auto bin_op = llvm::dyn_cast<llvm::BinaryOperator>(I);
-        if (!bin_op || !bin_op->getType()->isIntegerTy()) {
+        if (!bin_op || !bin_op->getType()->isIntOrIntVectorTy() || !IsRewritable(bin_op->getOpcode())) {
+            continue;
+        }
+
+        // with a budget fall back to fewer identities, then cheaper ones
+        // over fewer variables, then leaving the instruction alone
+        int depth = mba_depth;
+        int vars_count = mba_vars;
+        if (budget && !AffordIdentities(*budget, BB, depth, vars_count)) {
             continue;
         }
 
-        llvm::IRBuilder<> builder(bin_op);
+        ir_builder.SetInsertPoint(bin_op);
+        const auto previous = bin_op->getPrevNode();
 
         // useful variables in building the instruction for substitution
         const auto x = bin_op->getOperand(0);
         const auto y = bin_op->getOperand(1);
         // may not actually exist in which case y will just be selected
-        const auto const_operand = (llvm::dyn_cast<llvm::ConstantInt>(x)) ? x : y;
-        const auto non_const_operand = (!llvm::dyn_cast<llvm::ConstantInt>(x)) ? x : y;
+        const auto const_operand = (GetIntegerConstant(x)) ? x : y;
+        const auto non_const_operand = (!GetIntegerConstant(x)) ? x : y;
 
-        std::vector<llvm::Value *> vars{const_operand, non_const_operand, llvm::ConstantInt::get(bin_op->getType(), std::rand() % 255)};
-        // std::vector<llvm::Value *> vars{const_operand, non_const_operand, llvm::ConstantInt::get(bin_op->getType(), std::rand() % 255), llvm::ConstantInt::get(bin_op->getType(), std::rand() % 255)};
+        std::vector<llvm::Value *> vars{const_operand, non_const_operand};
+        while (static_cast<int>(vars.size()) < vars_count) {
+            vars.emplace_back(llvm::ConstantInt::get(bin_op->getType(), rng.Uniform(255)));
+        }
+        // std::vector<llvm::Value *> vars{const_operand, non_const_operand, llvm::ConstantInt::get(bin_op->getType(), rng.Uniform(255)), llvm::ConstantInt::get(bin_op->getType(), rng.Uniform(255))};
 
-        const auto x_expr = GetObfuscatedValue(builder, obfus::GenerateRandomMBAIdentity(builder, bin_op->getType(), vars), x);
-        const auto y_expr = GetObfuscatedValue(builder, obfus::GenerateRandomMBAIdentity(builder, bin_op->getType(), vars), y);
+        // with a depth of 1 only one random operand gets an identity
+        const bool skip_x = (depth == 1) && (rng.Uniform(2) == 0);
+        const bool skip_y = (depth == 1) && !skip_x;
+        const auto x_expr = (skip_x) ? x : GetObfuscatedValue(builder, rng, obfus::GenerateRandomMBAIdentity(builder, rng, bin_op->getType(), vars, MBASource::kTable, mba_stats), x);
+        const auto y_expr = (skip_y) ? y : GetObfuscatedValue(builder, rng, obfus::GenerateRandomMBAIdentity(builder, rng, bin_op->getType(), vars, MBASource::kTable, mba_stats), y);
 
 #ifdef DEBUG
         llvm::errs() << "Opcode: Instruction::" << I->getOpcodeName() << "\n";
@@ -69,79 +446,535 @@ bool TransformBinaryOperatorBasicBlock(llvm::BasicBlock &BB) {
         llvm::Value *new_value = nullptr;
         switch (I->getOpcode()) {
             case llvm::Instruction::Add:
-                new_value = builder.CreateAdd(x_expr, y_expr);
+                new_value = ir_builder.CreateAdd(x_expr, y_expr);
                 break;
             case llvm::Instruction::Sub:
-                new_value = builder.CreateSub(x_expr, y_expr);
+                new_value = ir_builder.CreateSub(x_expr, y_expr);
                 break;
             case llvm::Instruction::Xor:
-                new_value = builder.CreateXor(x_expr, y_expr);
+                new_value = ir_builder.CreateXor(x_expr, y_expr);
                 break;
             case llvm::Instruction::Or:
-                new_value = builder.CreateOr(x_expr, y_expr);
+                new_value = ir_builder.CreateOr(x_expr, y_expr);
                 break;
             case llvm::Instruction::And:
-                new_value = builder.CreateAnd(x_expr, y_expr);
+                new_value = ir_builder.CreateAnd(x_expr, y_expr);
                 break;
         }
         // if we have something to replace the instruction with, replace it
         if (new_value) {
             bin_op->replaceAllUsesWith(new_value);
+            replaced.emplace_back(bin_op);
             changed = true;
+            if (stats) {
+                stats->binary_operators++;
+            }
+        }
+        if (budget) {
+            budget->Charge((previous) ? std::next(previous->getIterator()) : BB.begin(), bin_op->getIterator(), depth, vars_count);
         }
     }
+
+    // their operands (original code, pooled constants) may go with them
+    uint64_t erased = 0;
+    for (const auto bin_op : replaced) {
+        erased += EraseDead(bin_op);
+    }
+    if (stats) {
+        stats->erased += erased;
+    }
     return changed;
 }
 
-bool TransformIntegerConstants(llvm::BasicBlock &BB) {
-    bool changed = false;
-
+/*
+Integer constant operands (compared, added, stored, passed, ...) are
+replaced by MBA expressions.  Each distinct constant is built once per pool
+and every use shares it: code outside of loops uses a pool right after the
+allocas, code inside a loop nest uses a pool in the preheader of the
+outermost loop that has one, so loops never recompute them.  The identities
+are built on a function argument, the value a constant is compared to may
+not be available in the pool.
+*/
+bool TransformIntegerConstants(llvm::Function &F, Random &rng, CostBudget *budget, TransformStats *stats,
+                               const llvm::SmallPtrSetImpl<const llvm::BasicBlock *> *skip, const MBAShape &shape, const int mba_vars) {
     // see https://sci-hub.ee/https://link.springer.com/chapter/10.1007/978-3-540-77535-5_5
-    // TODO: turn integer constants into complex expressions
-    for (auto I = BB.begin(); I != BB.end(); ++I) {
-        const auto icmp_op = llvm::dyn_cast<llvm::ICmpInst>(I);
-        if (!icmp_op || !icmp_op->getType()->isIntegerTy()) {
-            // if its not an integer comparison, go to next instruction
+    llvm::DominatorTree DT(F);
+    llvm::LoopInfo LI(DT);
+    // where a value needed at the end of BB is built, nullptr for the
+    // function pool
+    const auto pool_place = [&](llvm::BasicBlock *BB) {
+        llvm::BasicBlock *place = nullptr;
+        for (auto loop = LI.getLoopFor(BB); loop; loop = loop->getParentLoop()) {
+            if (const auto preheader = loop->getLoopPreheader()) {
+                place = preheader;
+            }
+        }
+        return place;
+    };
+
+    // collect everything first, the pools add blocks and constants of their own
+    std::vector<ConstantUse> uses;
+    for (auto &BB : F) {
+        if (skip && skip->count(&BB)) {
             continue;
         }
-        // if we do not have two operands
-        if (icmp_op->getNumOperands() != 2) {
+        for (auto &I : BB) {
+            for (unsigned i = 0; i < I.getNumOperands(); i++) {
+                const auto constant = GetIntegerConstant(I.getOperand(i));
+                // booleans only feed branches and selects
+                if (!constant || constant->getType()->getScalarSizeInBits() == 1 || !llvm::canReplaceOperandWithVariable(&I, i)) {
+                    continue;
+                }
+                // phi operands are needed at the end of the incoming block
+                const auto phi = llvm::dyn_cast<llvm::PHINode>(&I);
+                uses.push_back({&I, i, constant, pool_place((phi) ? phi->getIncomingBlock(i) : &BB)});
+            }
+        }
+    }
+
+    bool changed = false;
+    const auto entry = &F.getEntryBlock();
+    llvm::DenseMap<llvm::BasicBlock *, std::unique_ptr<ConstantPool>> pools;
+    for (const auto &use : uses) {
+        auto &pool = pools[use.place];
+        const auto cached = (pool) ? pool->values.find(use.constant) : decltype(pool->values.end())();
+        if (pool && cached != pool->values.end()) {
+            use.user->setOperand(use.index, cached->second);
+            changed = true;
+            if (stats) {
+                stats->constants++;
+            }
             continue;
         }
 
-        const auto x = icmp_op->getOperand(0);
-        const auto y = icmp_op->getOperand(1);
-        const auto x_value = llvm::dyn_cast<llvm::ConstantInt>(x);
-        const auto y_value = llvm::dyn_cast<llvm::ConstantInt>(y);
-        // if neither are const integers
-        if (!x_value && !y_value) {
+        int depth = 1;
+        int vars_count = mba_vars;
+        const auto &place = (use.place) ? *use.place : *entry;
+        if (budget && !AffordIdentities(*budget, place, depth, vars_count)) {
             continue;
         }
-        const int value_replace_index = (x_value) ? 0 : 1;
-        const auto value_replace = (value_replace_index == 0) ? x_value : y_value;
+        if (!pool) {
+            pool = std::make_unique<ConstantPool>(CreatePoolBlock(F, use.place), shape);
+            // charged at the rate it was afforded at
+            if (budget) {
+                budget->InheritWeight(*pool->block, place);
+            }
+        }
+        const auto terminator = pool->block->getTerminator();
+        const auto previous = terminator->getPrevNode();
+
+        pool->ir_builder.SetCurrentDebugLocation(GetUseLocation(use));
+        const auto type = use.constant->getType();
+        std::vector<llvm::Value *> vars{pool->Variable(F, type), llvm::ConstantInt::get(type, rng.Uniform(255))};
+        while (static_cast<int>(vars.size()) < vars_count) {
+            vars.emplace_back(llvm::ConstantInt::get(type, rng.Uniform(255)));
+        }
+        const auto zero_expr = obfus::GenerateRandomMBAIdentity(pool->builder, rng, type, vars, MBASource::kTable, (stats) ? &stats->mba : nullptr);
+        const auto value = (use.constant->isNullValue()) ? zero_expr : GetObfuscatedValue(pool->builder, rng, zero_expr, use.constant);
+        pool->values[use.constant] = value;
+        use.user->setOperand(use.index, value);
+        changed = true;
+        if (stats) {
+            stats->constants++;
+        }
+        if (budget) {
+            budget->Charge((previous) ? std::next(previous->getIterator()) : pool->block->begin(), terminator->getIterator(), depth, vars_count);
+        }
+#ifdef DEBUG
+        llvm::errs() << "Pooled constant: " << *use.constant << "\n";
+#endif
+    }
 
-        const auto same = (value_replace_index == 0) ? y : x;
-        const auto int_type = value_replace->getType();
+    // values of constants whose users were already dead
+    for (const auto &pool : pools) {
+        if (!pool.second) {
+            continue;
+        }
+        for (auto &I : llvm::make_early_inc_range(llvm::reverse(*pool.second->block))) {
+            if (!llvm::isInstructionTriviallyDead(&I)) {
+                continue;
+            }
+            I.eraseFromParent();
+            if (stats) {
+                stats->erased++;
+            }
+        }
+    }
+    return changed;
+}
 
-        llvm::IRBuilder<> builder(icmp_op);
+// landing pads stay where they are and keep their unwind edges, the funclet
+// pads of Windows EH (catchswitch, catchpad, cleanuppad) would need every
+// block to stay inside its funclet so functions with them are not flattened
+static bool HasFuncletPads(const llvm::Function &F) {
+    return llvm::any_of(F, [](const llvm::BasicBlock &BB) {
+        return BB.isEHPad() && !BB.isLandingPad();
+    });
+}
 
-        // std::vector<llvm::Value *> vars{llvm::ConstantInt::get(int_type, std::rand() % 255), same};
-        std::vector<llvm::Value *> vars{llvm::ConstantInt::get(int_type, std::rand() % 255), same, llvm::ConstantInt::get(int_type, std::rand() % 255)};
-        // std::vector<llvm::Value *> vars{llvm::ConstantInt::get(int_type, std::rand() % 255), same, llvm::ConstantInt::get(int_type, std::rand() % 255), llvm::ConstantInt::get(int_type, std::rand() % 255)};
+// asm goto (callbr) jumps to its labels from inside the asm, those edges
+// can not go through a dispatcher and the callbr itself must stay
+static bool HasCallBr(const llvm::Function &F) {
+    return llvm::any_of(F, [](const llvm::BasicBlock &BB) { return llvm::isa<llvm::CallBrInst>(BB.getTerminator()); });
+}
 
-        const auto zero_expr = obfus::GenerateRandomMBAIdentity(builder, int_type, vars);
-        if (value_replace->getSExtValue() == 0) {
-            icmp_op->setOperand(value_replace_index, zero_expr);
-        } else {
-            icmp_op->setOperand(value_replace_index, GetObfuscatedValue(builder, zero_expr, value_replace));
+// gives the normal edge of every invoke a block of its own that ends in an
+// unconditional branch, which the dispatcher takes over like any other.
+// returns those blocks, only their invoke enters them
+static llvm::SmallPtrSet<llvm::BasicBlock *, 8> SplitInvokeEdges(llvm::Function &F, obfus::CostBudget *budget) {
+    std::vector<llvm::InvokeInst *> invokes;
+    for (auto &BB : F) {
+        if (const auto invoke = llvm::dyn_cast<llvm::InvokeInst>(BB.getTerminator())) {
+            invokes.emplace_back(invoke);
         }
-        changed = true;
+    }
+    llvm::SmallPtrSet<llvm::BasicBlock *, 8> edges;
+    for (const auto invoke : invokes) {
+        const auto from = invoke->getParent();
+        const auto to = invoke->getNormalDest();
+        const auto edge = llvm::BasicBlock::Create(F.getContext(), "InvokeCont", &F, to);
+        llvm::BranchInst::Create(to, edge)->setDebugLoc(invoke->getDebugLoc());
+        to->replacePhiUsesWith(from, edge);
+        invoke->setNormalDest(edge);
+        edges.insert(edge);
+        if (budget) {
+            budget->InheritWeight(*edge, *from);
+        }
+    }
+    return edges;
+}
+
+/*
+kIndirectBr flattening (computed goto style dispatch).
+Every branch becomes a load from a per function table of blockaddresses,
+indexed by the next state, followed by an indirectbr.  The table is shuffled
+so the state values say nothing about block order, and each source block
+keeps its own indirect jump which gives the branch predictor one entry per
+block instead of a single shared switch.  Since the real successors stay in
+the indirectbr destination lists the CFG edges do not change and no phi or
+value needs repairing.  Functions containing indirectbr are never inlined.
+An invoke's normal edge goes through the table from a block of its own, its
+unwind edge stays direct.
+*/
+static bool FlattenIndirectBr(llvm::Function &F, obfus::Random &rng, obfus::TransformStats *stats) {
+    std::vector<llvm::BranchInst *> branches;
+    std::vector<llvm::BasicBlock *> targets;
+    llvm::DenseMap<llvm::BasicBlock *, uint32_t> states;
+    for (auto &BB : F) {
+        const auto branch = llvm::dyn_cast<llvm::BranchInst>(BB.getTerminator());
+        if (!branch) {
+            continue;
+        }
+        branches.emplace_back(branch);
+        for (const auto successor : branch->successors()) {
+            if (states.try_emplace(successor, 0).second) {
+                targets.emplace_back(successor);
+            }
+        }
+    }
+    if (targets.empty()) {
+        return false;
+    }
+
+    // shuffle so table position is unrelated to block order
+    for (size_t i = 0; i + 1 < targets.size(); i++) {
+        std::swap(targets[i], targets[i + rng.Uniform(targets.size() - i)]);
+    }
+    const auto pointer_type = llvm::Type::getInt8PtrTy(F.getContext());
+    std::vector<llvm::Constant *> addresses;
+    for (size_t i = 0; i < targets.size(); i++) {
+        states[targets[i]] = i;
+        addresses.emplace_back(llvm::BlockAddress::get(&F, targets[i]));
+    }
+    const auto table_type = llvm::ArrayType::get(pointer_type, addresses.size());
+    // appended, SortDispatchTables orders the tables once the module is done
+    const auto table = new llvm::GlobalVariable(*F.getParent(), table_type, true, llvm::GlobalValue::PrivateLinkage,
+                                                llvm::ConstantArray::get(table_type, addresses), F.getName() + ".dispatch");
+
+    const DispatcherLocations locations(F);
+    for (const auto branch : branches) {
+        llvm::IRBuilder<> builder(branch);
+        builder.SetCurrentDebugLocation(locations.Get(branch->getDebugLoc()));
+        llvm::Value *state = builder.getInt32(states[branch->getSuccessor(0)]);
+        if (branch->isConditional()) {
+            state = builder.CreateSelect(branch->getCondition(), state, builder.getInt32(states[branch->getSuccessor(1)]));
+        }
+        const auto address = builder.CreateLoad(pointer_type, builder.CreateInBoundsGEP(table_type, table, {builder.getInt32(0), state}));
+        const auto indirect_br = builder.CreateIndirectBr(address, branch->getNumSuccessors());
+        for (const auto successor : branch->successors()) {
+            if (!llvm::is_contained(indirect_br->successors(), successor)) {
+                indirect_br->addDestination(successor);
+            } else {
+                // br %c, %a, %a was two edges and phis in %a have an entry
+                // for each of them
+                successor->removePredecessor(branch->getParent(), true);
+            }
+        }
+        branch->eraseFromParent();
+    }
+    if (stats) {
+        stats->flattened_blocks += branches.size();
+    }
+
 #ifdef DEBUG
-        llvm::errs() << "Replaced constant: " << value_replace->getSExtValue() << "\n";
+    llvm::errs() << "Flattened (indirectbr): " << F.getName() << "!\n";
 #endif
+    return true;
+}
+
+// one level of the loop nest in kLoops flattening
+struct LoopDispatcher {
+    llvm::BasicBlock *block;
+    llvm::AllocaInst *state;
+    llvm::SwitchInst *sw;
+};
+
+// kLoops only reroutes branches, switches and invokes
+static bool CanFlattenLoops(const llvm::Function &F) {
+    return llvm::all_of(F, [](const llvm::BasicBlock &BB) {
+        const auto terminator = BB.getTerminator();
+        return terminator->getNumSuccessors() == 0 || llvm::isa<llvm::BranchInst>(terminator) || llvm::isa<llvm::SwitchInst>(terminator) ||
+               llvm::isa<llvm::InvokeInst>(terminator);
+    });
+}
+
+/*
+kLoops flattening (one dispatcher per loop nest level).
+The blocks outside of any loop and the blocks of every loop that has
+subloops go behind a dispatcher of their own, and a loop's dispatcher becomes
+its header.  Innermost loops are not touched: they are entered through their
+header like any other block of the enclosing level and their back edges stay
+direct, so the hot part of the code only pays for a dispatcher round trip
+when a loop is entered or left and later passes can still hoist, unroll
+and vectorize it.  Loop nesting already gives single entry regions, so
+RegionInfo is not needed.
+Values living across blocks are demoted to the stack while the CFG is
+rewritten and promoted again afterwards, the result is plain SSA unless the
+promotion would be as big as kSSA's phis are allowed to get, then they stay
+on the stack like kReg2Mem.
+An invoke's normal edge is routed from a block of its own, invoke_edges
+from SplitInvokeEdges (an escaping invoke result is stored on that edge, so
+it has to be split before the demotion).  Landing pads get no case and keep
+their unwind edges, so a throw only pays for the dispatch after the pad.
+*/
+static bool FlattenLoops(llvm::Function &F, obfus::Random &rng, const llvm::SmallPtrSetImpl<llvm::BasicBlock *> &invoke_edges, obfus::CostBudget *budget,
+                         obfus::TransformStats *stats) {
+    const auto entered_directly = [&](llvm::BasicBlock *BB) {
+        return BB->isLandingPad() || invoke_edges.count(BB);
+    };
+    auto &context = F.getContext();
+    const auto first_bb = &F.getEntryBlock();
+    std::vector<llvm::BasicBlock *> original_bb;
+    for (auto &BB : F) {
+        original_bb.emplace_back(&BB);
     }
 
-    return changed;
+    // same order as reg2mem: escaping values (phis included) get a slot
+    // written next to their definition, then phis get one written by the
+    // predecessors
+    std::vector<llvm::AllocaInst *> allocas;
+    std::vector<llvm::AllocaInst *> states;
+    {
+        std::vector<llvm::Instruction *> escaping;
+        std::vector<llvm::PHINode *> phis;
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                if (!(llvm::isa<llvm::AllocaInst>(I) && &BB == first_bb) && I.isUsedOutsideOfBlock(&BB)) {
+                    escaping.emplace_back(&I);
+                }
+                if (const auto phi = llvm::dyn_cast<llvm::PHINode>(&I)) {
+                    phis.emplace_back(phi);
+                }
+            }
+        }
+        const auto alloca_point = &*first_bb->getFirstInsertionPt();
+        for (const auto I : escaping) {
+            allocas.emplace_back(llvm::DemoteRegToStack(*I, false, alloca_point));
+        }
+        for (const auto phi : phis) {
+            // unused phis are just erased
+            if (const auto slot = llvm::DemotePHIToStack(phi, alloca_point)) {
+                allocas.emplace_back(slot);
+            }
+        }
+    }
+
+    llvm::DominatorTree DT(F);
+    llvm::LoopInfo LI(DT);
+    const auto flattened = [](const llvm::Loop *L) {
+        return !L || !L->getSubLoops().empty();
+    };
+
+    // dispatchers, the top level one is keyed by nullptr
+    const DispatcherLocations locations(F);
+    llvm::IRBuilder<> alloca_builder(first_bb, first_bb->getFirstInsertionPt());
+    llvm::DenseMap<const llvm::Loop *, LoopDispatcher> dispatchers;
+    const auto create_dispatcher = [&](const llvm::Loop *L) {
+        const auto block = llvm::BasicBlock::Create(context, "Entry", &F);
+        const auto sw_default = llvm::BasicBlock::Create(context, "Default", &F);
+        const auto state = alloca_builder.CreateAlloca(alloca_builder.getInt32Ty());
+        llvm::IRBuilder<> sw_builder(block);
+        sw_builder.SetCurrentDebugLocation(locations.Get());
+        const auto sw = sw_builder.CreateSwitch(sw_builder.CreateLoad(sw_builder.getInt32Ty(), state), sw_default);
+        llvm::BranchInst::Create(block, sw_default)->setDebugLoc(locations.Get());
+        dispatchers[L] = {block, state, sw};
+        states.emplace_back(state);
+    };
+    create_dispatcher(nullptr);
+    for (const auto L : LI.getLoopsInPreorder()) {
+        if (flattened(L)) {
+            create_dispatcher(L);
+        }
+    }
+
+    llvm::DenseMap<llvm::BasicBlock *, llvm::ConstantInt *> case_values;
+    llvm::DenseSet<uint32_t> used_states;
+    const auto add_case = [&](const llvm::Loop *L, llvm::BasicBlock *BB) {
+        uint32_t state = 0;
+        do {
+            state = static_cast<uint32_t>(rng());
+        } while (!used_states.insert(state).second);
+        const auto case_num = llvm::ConstantInt::get(llvm::Type::getInt32Ty(context), state);
+        dispatchers[L].sw->addCase(case_num, BB);
+        case_values[BB] = case_num;
+    };
+    // the blocks that branch to each dispatcher, for the budget's weights
+    llvm::DenseMap<llvm::BasicBlock *, std::vector<llvm::BasicBlock *>> jumpers;
+    // a flattened loop is entered through a block that sets the loop's state
+    // to its header, the dispatcher is the loop's header from then on
+    llvm::DenseMap<const llvm::Loop *, llvm::BasicBlock *> loop_entries;
+    for (const auto BB : original_bb) {
+        const auto L = LI.getLoopFor(BB);
+        if (entered_directly(BB)) {
+            continue;
+        }
+        if (!flattened(L)) {
+            if (BB == L->getHeader()) {
+                add_case(L->getParentLoop(), BB);
+            }
+            continue;
+        }
+        if (BB != first_bb) {
+            add_case(L, BB);
+        }
+        if (L && BB == L->getHeader()) {
+            const auto loop_entry = llvm::BasicBlock::Create(context, "LoopEntry", &F);
+            llvm::IRBuilder<> entry_builder(loop_entry);
+            entry_builder.SetCurrentDebugLocation(locations.Get());
+            entry_builder.CreateStore(case_values[BB], dispatchers[L].state);
+            entry_builder.CreateBr(dispatchers[L].block);
+            loop_entries[L] = loop_entry;
+            jumpers[dispatchers[L].block].emplace_back(loop_entry);
+            if (budget) {
+                // runs once per entry into the loop
+                std::vector<llvm::BasicBlock *> outside;
+                for (const auto predecessor : llvm::predecessors(BB)) {
+                    if (!L->contains(predecessor)) {
+                        outside.emplace_back(predecessor);
+                    }
+                }
+                budget->SumWeights(*loop_entry, outside);
+            }
+            add_case(L->getParentLoop(), loop_entry);
+        }
+    }
+
+    // dispatcher and state an edge goes through, nullptr for edges inside an
+    // innermost loop and the edges of an invoke
+    const auto route = [&](llvm::BasicBlock *from, llvm::BasicBlock *to) -> std::pair<const LoopDispatcher *, llvm::ConstantInt *> {
+        if (entered_directly(to)) {
+            return {nullptr, nullptr};
+        }
+        const auto L = LI.getLoopFor(to);
+        if (!flattened(L)) {
+            if (L->contains(from)) {
+                return {nullptr, nullptr};
+            }
+            return {&dispatchers[L->getParentLoop()], case_values[to]};
+        }
+        if (L && !L->contains(from)) {
+            return {&dispatchers[L->getParentLoop()], case_values[loop_entries[L]]};
+        }
+        return {&dispatchers[L], case_values[to]};
+    };
+
+    uint64_t routed = 0;
+    for (const auto BB : original_bb) {
+        const auto terminator = BB->getTerminator();
+        llvm::SmallVector<std::pair<const LoopDispatcher *, llvm::ConstantInt *>, 2> routes;
+        for (const auto successor : llvm::successors(terminator)) {
+            routes.emplace_back(route(BB, successor));
+        }
+        if (routes.empty()) {
+            continue;
+        }
+        const bool one_level = llvm::all_of(routes, [&](const auto &r) {
+            return r.first && r.first == routes.front().first;
+        });
+        if (one_level) {
+            // the whole terminator becomes a state update like in
+            // TransformFlatten
+            llvm::IRBuilder<> case_builder(terminator);
+            case_builder.SetCurrentDebugLocation(locations.Get(terminator->getDebugLoc()));
+            llvm::Value *state = routes.front().second;
+            if (const auto branch = llvm::dyn_cast<llvm::BranchInst>(terminator)) {
+                if (branch->isConditional()) {
+                    state = case_builder.CreateSelect(branch->getCondition(), routes[0].second, routes[1].second);
+                }
+            } else if (const auto switch_inst = llvm::dyn_cast<llvm::SwitchInst>(terminator)) {
+                for (const auto &switch_case : switch_inst->cases()) {
+                    const auto matches = case_builder.CreateICmpEQ(switch_inst->getCondition(), switch_case.getCaseValue());
+                    state = case_builder.CreateSelect(matches, routes[switch_case.getSuccessorIndex()].second, state);
+                }
+            }
+            case_builder.CreateStore(state, routes.front().first->state);
+            case_builder.CreateBr(routes.front().first->block);
+            terminator->eraseFromParent();
+            jumpers[routes.front().first->block].emplace_back(BB);
+            routed++;
+            continue;
+        }
+        // edges leave or enter an innermost loop, only those go through a
+        // dispatcher
+        for (unsigned i = 0; i < routes.size(); i++) {
+            if (!routes[i].first) {
+                continue;
+            }
+            const auto trampoline = llvm::BasicBlock::Create(context, "", &F);
+            llvm::IRBuilder<> trampoline_builder(trampoline);
+            trampoline_builder.SetCurrentDebugLocation(locations.Get(terminator->getDebugLoc()));
+            trampoline_builder.CreateStore(routes[i].second, routes[i].first->state);
+            trampoline_builder.CreateBr(routes[i].first->block);
+            terminator->setSuccessor(i, trampoline);
+            jumpers[routes[i].first->block].emplace_back(trampoline);
+            if (budget) {
+                budget->InheritWeight(*trampoline, *BB);
+            }
+            routed++;
+        }
+    }
+
+    // every promoted value ends up with a phi in most dispatchers
+    if (allocas.size() * original_bb.size() > kMaxSSAPhiOperands) {
+        allocas.clear();
+    }
+    allocas.insert(allocas.end(), states.begin(), states.end());
+    llvm::DominatorTree flattened_DT(F);
+    llvm::PromoteMemToReg(allocas, flattened_DT);
+    locations.Fill(F);
+    if (budget) {
+        for (const auto &dispatcher : dispatchers) {
+            budget->SumWeights(*dispatcher.second.block, jumpers[dispatcher.second.block]);
+        }
+    }
+    if (stats) {
+        stats->flattened_blocks += routed;
+    }
+
+#ifdef DEBUG
+    llvm::errs() << "Flattened (loops): " << F.getName() << "!\n";
+#endif
+    return true;
 }
 
 /*
@@ -149,19 +982,50 @@ Source: https://github.com/chenx6/baby_obfuscator/blob/master/src/Flattening.cpp
 Copyright (c) 2020 chen_null
 Adjusted to fit the Google C++ style guide
 */
-bool TransformFlatten(llvm::Function &F) {
+bool TransformFlatten(llvm::Function &F, Random &rng, FlattenMode mode, CostBudget *budget, TransformStats *stats) {
     // Only one BB in this Function
     if (F.size() <= 1) {
         return false;
     }
 
+    // unreachable blocks would become reachable through the dispatcher and
+    // they are allowed to contain things like self referencing instructions
+    llvm::removeUnreachableBlocks(F);
+    if (F.size() <= 1) {
+        return false;
+    }
+    if (HasFuncletPads(F) || HasCallBr(F) || (mode == FlattenMode::kLoops && !CanFlattenLoops(F))) {
+        return false;
+    }
+
+    // invokes are dispatched from a block on their normal edge, while landing
+    // pads are only entered through the unwind edge and get no case, in
+    // every mode
+    const auto invoke_edges = SplitInvokeEdges(F, budget);
+    if (mode == FlattenMode::kIndirectBr) {
+        return FlattenIndirectBr(F, rng, stats);
+    }
+    if (mode == FlattenMode::kLoops) {
+        return FlattenLoops(F, rng, invoke_edges, budget, stats);
+    }
+    if (mode == FlattenMode::kSSA && !CanFlattenSSA(F)) {
+#ifdef DEBUG
+        llvm::errs() << "Flattening " << F.getName() << " with reg2mem instead of ssa\n";
+#endif
+        mode = FlattenMode::kReg2Mem;
+    }
+
+    // values crossing those direct edges are beyond RepairSSA, so kSSA takes
+    // kReg2Mem's route and promotes the slots again at the end
+    const bool promote = mode == FlattenMode::kSSA && !invoke_edges.empty();
+    if (promote) {
+        mode = FlattenMode::kReg2Mem;
+    }
+
     // Insert All BB into original_bb
     llvm::SmallVector<llvm::BasicBlock *, 0> original_bb;
     for (auto &BB : F) {
         original_bb.emplace_back(&BB);
-        if (llvm::isa<llvm::InvokeInst>(BB.getTerminator())) {
-            return false;
-        }
     }
 
     // Remove first BB
@@ -171,13 +1035,18 @@ bool TransformFlatten(llvm::Function &F) {
     const auto first_bb = &*F.begin();
     const auto first_bb_terminator = first_bb->getTerminator();
     if (llvm::isa<llvm::BranchInst>(first_bb_terminator) ||
-        llvm::isa<llvm::IndirectBrInst>(first_bb_terminator)) {
+        llvm::isa<llvm::SwitchInst>(first_bb_terminator) ||
+        llvm::isa<llvm::IndirectBrInst>(first_bb_terminator) ||
+        llvm::isa<llvm::InvokeInst>(first_bb_terminator)) {
         llvm::BasicBlock::iterator iter = first_bb->end();
         if (first_bb->size() > 1) {
             --iter;
         }
         const auto temp_bb = first_bb->splitBasicBlock(--iter);
         original_bb.insert(original_bb.begin(), temp_bb);
+        if (budget) {
+            budget->InheritWeight(*temp_bb, *first_bb);
+        }
     }
 
     // Remove first_bb
@@ -187,70 +1056,161 @@ bool TransformFlatten(llvm::Function &F) {
     const auto loop_entry = llvm::BasicBlock::Create(F.getContext(), "Entry", &F);
     const auto loop_end = llvm::BasicBlock::Create(F.getContext(), "End", &F);
     const auto sw_default = llvm::BasicBlock::Create(F.getContext(), "Default", &F);
-    // Create switch variable
+    const DispatcherLocations locations(F);
     llvm::IRBuilder<> entry_builder(first_bb, first_bb->end());
-    const auto sw_ptr = entry_builder.CreateAlloca(entry_builder.getInt32Ty());
-    const auto store_rng = entry_builder.CreateStore(entry_builder.getInt32(std::rand()), sw_ptr);
-    entry_builder.CreateBr(loop_entry);
-    // Create switch statement
     llvm::IRBuilder<> sw_builder(loop_entry);
-    const auto sw_inst = sw_builder.CreateSwitch(sw_builder.CreateLoad(sw_ptr), sw_default, 0);
-    llvm::BranchInst::Create(loop_entry, sw_default);
-    llvm::BranchInst::Create(loop_entry, loop_end);
+    entry_builder.SetCurrentDebugLocation(locations.Get());
+    sw_builder.SetCurrentDebugLocation(locations.Get());
+    // Create switch variable
+    // kReg2Mem: the state lives in an alloca that every block stores to
+    // kSSA: the state is a phi in the dispatcher and blocks branch to it
+    // directly, so End is not needed
+    llvm::AllocaInst *sw_ptr = nullptr;
+    llvm::StoreInst *store_rng = nullptr;
+    llvm::PHINode *sw_phi = nullptr;
+    llvm::BasicBlock *dispatch = loop_end;
+    if (mode == FlattenMode::kSSA) {
+        dispatch = loop_entry;
+        sw_phi = sw_builder.CreatePHI(sw_builder.getInt32Ty(), original_bb.size() + 2);
+        entry_builder.CreateBr(loop_entry);
+    } else {
+        sw_ptr = entry_builder.CreateAlloca(entry_builder.getInt32Ty());
+        store_rng = entry_builder.CreateStore(entry_builder.getInt32(static_cast<uint32_t>(rng())), sw_ptr);
+        entry_builder.CreateBr(loop_entry);
+        llvm::BranchInst::Create(loop_entry, loop_end)->setDebugLoc(locations.Get());
+    }
+    // Create switch statement
+    const auto sw_inst = sw_builder.CreateSwitch((sw_phi) ? static_cast<llvm::Value *>(sw_phi) : sw_builder.CreateLoad(sw_builder.getInt32Ty(), sw_ptr), sw_default, original_bb.size());
+    llvm::BranchInst::Create(loop_entry, sw_default)->setDebugLoc(locations.Get());
 
     // Put all BB into switch Instruction
     // using a ref here makes no sense because orginal_bb already uses pointers
+    // states are unique (32 bit values collide quickly with 10k+ blocks) and
+    // kept in a map, SwitchInst::findCaseDest is a linear scan
+    llvm::DenseMap<llvm::BasicBlock *, llvm::ConstantInt *> case_values;
+    llvm::DenseSet<uint32_t> used_states;
     for (const auto BB : original_bb) {
         BB->moveBefore(loop_end);
-        sw_inst->addCase(sw_builder.getInt32(std::rand()), BB);
+        if (BB->isLandingPad() || invoke_edges.count(BB)) {
+            continue;
+        }
+        uint32_t state = 0;
+        do {
+            state = static_cast<uint32_t>(rng());
+        } while (!used_states.insert(state).second);
+        const auto case_num = sw_builder.getInt32(state);
+        sw_inst->addCase(case_num, BB);
+        case_values[BB] = case_num;
     }
+    const auto find_case = [&](llvm::BasicBlock *BB) {
+        const auto found = case_values.find(BB);
+        // only first_bb, landing pads and invoke edges have no case and
+        // nothing can branch to them
+        return (found != case_values.end()) ? found->second : sw_builder.getInt32(static_cast<uint32_t>(rng()));
+    };
+
+    // hand the next state to the dispatcher
+    const auto set_state = [&](llvm::IRBuilder<> &case_builder, llvm::Value *state) {
+        if (sw_phi) {
+            sw_phi->addIncoming(state, case_builder.GetInsertBlock());
+        } else {
+            case_builder.CreateStore(state, sw_ptr);
+        }
+        case_builder.CreateBr(dispatch);
+    };
 
     // Recalculate switch Instruction
+    std::vector<Jumper> jumpers;
     for (const auto BB : original_bb) {
-        switch (BB->getTerminator()->getNumSuccessors()) {
-            case 0:
-                // No terminator
-                break;
-            case 1: {
+        const auto terminator = BB->getTerminator();
+        llvm::IRBuilder<> case_builder(BB, BB->end());
+        case_builder.SetCurrentDebugLocation(locations.Get(terminator->getDebugLoc()));
+        llvm::Value *state = nullptr;
+        if (const auto branch = llvm::dyn_cast<llvm::BranchInst>(terminator)) {
+            if (branch->isUnconditional()) {
                 // Terminator is a non-condition jump
-                const auto terminator = BB->getTerminator();
-                // Find successor's case condition
-                auto case_num = sw_inst->findCaseDest(terminator->getSuccessor(0));
-                if (case_num == nullptr) {
-                    case_num = sw_builder.getInt32(std::rand());
-                }
-                // Connect this BB to successor
-                llvm::IRBuilder<> case_builder(BB, BB->end());
-                case_builder.CreateStore(case_num, sw_ptr);
-                case_builder.CreateBr(loop_end);
-                terminator->eraseFromParent();
-            } break;
-            case 2: {
+                state = find_case(branch->getSuccessor(0));
+            } else {
                 // Terminator is a condition jump
-                const auto terminator = BB->getTerminator();
-                auto truecase_num = sw_inst->findCaseDest(terminator->getSuccessor(0));
-                auto falsecase_num = sw_inst->findCaseDest(terminator->getSuccessor(1));
-                if (truecase_num == nullptr) {
-                    truecase_num = sw_builder.getInt32(std::rand());
-                }
-                if (falsecase_num == nullptr) {
-                    falsecase_num = sw_builder.getInt32(std::rand());
+                const auto truecase_num = find_case(branch->getSuccessor(0));
+                const auto falsecase_num = find_case(branch->getSuccessor(1));
+                // Select the next BB to be executed
+                state = case_builder.CreateSelect(branch->getCondition(), truecase_num, falsecase_num);
+            }
+        } else if (const auto switch_inst = llvm::dyn_cast<llvm::SwitchInst>(terminator)) {
+            // case values of a switch are unique so at most one select matches
+            state = find_case(switch_inst->getDefaultDest());
+            for (const auto &switch_case : switch_inst->cases()) {
+                const auto matches = case_builder.CreateICmpEQ(switch_inst->getCondition(), switch_case.getCaseValue());
+                state = case_builder.CreateSelect(matches, find_case(switch_case.getCaseSuccessor()), state);
+            }
+        }
+        // No successors (returns, resume), or indirectbr and invoke which
+        // keep their edges
+        if (!state) {
+            continue;
+        }
+        const auto successors = llvm::successors(terminator);
+        jumpers.push_back({BB, state, {successors.begin(), successors.end()}});
+        // Connect this BB to successor
+        set_state(case_builder, state);
+        terminator->eraseFromParent();
+    }
+
+    if (budget) {
+        // the dispatcher runs once when the function is entered and once for
+        // every jump back to it
+        std::vector<llvm::BasicBlock *> dispatching;
+        for (const auto &jumper : jumpers) {
+            dispatching.emplace_back(jumper.block);
+        }
+        if (mode != FlattenMode::kSSA) {
+            budget->SumWeights(*loop_end, dispatching);
+            dispatching = {loop_end};
+        }
+        dispatching.emplace_back(first_bb);
+        budget->SumWeights(*loop_entry, dispatching);
+    }
+
+    if (mode == FlattenMode::kSSA) {
+        loop_end->eraseFromParent();
+        // Set the state's origin value, let the first BB executed first
+        sw_phi->addIncoming(case_values[original_bb.front()], first_bb);
+        sw_phi->addIncoming(sw_phi, sw_default);
+        RepairSSA(first_bb, loop_entry, sw_default, original_bb, jumpers, case_values);
+    } else {
+        // Set sw_var's origin value, let the first BB executed first
+        store_rng->setOperand(0, case_values[original_bb.front()]);
+
+        // Demote register and phi to memory.  promote takes the state and
+        // reg2mem's slots back to registers, not the function's own allocas
+        llvm::SmallPtrSet<const llvm::Instruction *, 16> own_allocas;
+        if (promote) {
+            for (const auto &I : *first_bb) {
+                if (llvm::isa<llvm::AllocaInst>(I) && &I != sw_ptr) {
+                    own_allocas.insert(&I);
                 }
-                llvm::IRBuilder<> case_builder(BB, BB->end());
-                if (llvm::BranchInst *endBr = llvm::dyn_cast<llvm::BranchInst>(BB->getTerminator())) {
-                    // Select the next BB to be executed
-                    case_builder.CreateStore(case_builder.CreateSelect(endBr->getCondition(), truecase_num, falsecase_num), sw_ptr);
-                    case_builder.CreateBr(loop_end);
-                    terminator->eraseFromParent();
+            }
+        }
+        // a pass object per call, functions may be flattened on several threads
+        const std::unique_ptr<llvm::FunctionPass> reg2mem(llvm::createDemoteRegisterToMemoryPass());
+        reg2mem->runOnFunction(F);
+        if (promote) {
+            std::vector<llvm::AllocaInst *> allocas;
+            for (auto &I : *first_bb) {
+                const auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&I);
+                if (alloca && !own_allocas.count(alloca) && llvm::isAllocaPromotable(alloca)) {
+                    allocas.emplace_back(alloca);
                 }
-            } break;
+            }
+            llvm::DominatorTree DT(F);
+            llvm::PromoteMemToReg(allocas, DT);
         }
+        locations.Fill(F);
+    }
+    if (stats) {
+        stats->flattened_blocks += original_bb.size();
     }
-    // Set sw_var's origin value, let the first BB executed first
-    store_rng->setOperand(0, sw_inst->findCaseDest(*original_bb.begin()));
-
-    // Demote register and phi to memory
-    kReg2MemPass->runOnFunction(F);
 
 #ifdef DEBUG
     llvm::errs() << "Flattened: " << F.getName() << "!\n";
@@ -258,4 +1218,24 @@ bool TransformFlatten(llvm::Function &F) {
     return true;
 }
 
+void SortDispatchTables(llvm::Module &M) {
+    std::vector<llvm::GlobalVariable *> tables;
+    for (auto &G : M.globals()) {
+        if (G.hasPrivateLinkage() && G.getName().endswith(".dispatch")) {
+            tables.emplace_back(&G);
+        }
+    }
+    // names are unique within a module
+    std::sort(tables.begin(), tables.end(), [](const llvm::GlobalVariable *a, const llvm::GlobalVariable *b) { return a->getName() < b->getName(); });
+    for (const auto table : tables) {
+#if LLVM_VERSION_MAJOR >= 17
+        M.removeGlobalVariable(table);
+        M.insertGlobalVariable(table);
+#else
+        M.getGlobalList().remove(table);
+        M.getGlobalList().push_back(table);
+#endif
+    }
+}
+
 }  // namespace obfus
\ No newline at end of file
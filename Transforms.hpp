@@ -1,13 +1,66 @@
 #ifndef TRANSFORMS_HPP
 #define TRANSFORMS_HPP
 
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Module.h>
+
+#include "CostBudget.hpp"
+#include "DeriveZeroMBA.hpp"
+#include "Random.hpp"
 
 namespace obfus {
 
-bool TransformBinaryOperatorBasicBlock(llvm::BasicBlock &BB);
-bool TransformIntegerConstants(llvm::BasicBlock &BB);
-bool TransformFlatten(llvm::Function &F);
+enum class FlattenMode {
+    // dispatcher state in an alloca, every cross block value and phi is
+    // demoted to the stack with reg2mem
+    kReg2Mem,
+    // dispatcher state is a phi in the dispatcher block and only values
+    // whose definition stops dominating their uses are threaded through
+    // phis there, nothing goes through memory
+    kSSA,
+    // threaded dispatch: no central dispatcher, every block looks its
+    // successor up in a shuffled blockaddress table and jumps there with
+    // its own indirectbr
+    kIndirectBr,
+    // one dispatcher per level of the loop nest: the function body outside
+    // of loops and every loop that contains other loops get their own,
+    // innermost loops are left intact so LICM and the vectorizers still
+    // see them
+    kLoops,
+};
+
+// what the transforms did, accumulated over every call it is passed to
+struct TransformStats {
+    MBAStats mba;
+    uint64_t binary_operators = 0;
+    uint64_t constants = 0;
+    uint64_t flattened_blocks = 0;
+    // replaced operators and the generated or original code they left dead
+    uint64_t erased = 0;
+};
+
+// mba_depth is the number of operands (0-2) of each binary operator that
+// get hidden behind an MBA identity
+// with a budget the MBA transforms downgrade (fewer identities, then
+// identities over fewer variables) or skip rewrites once it runs low
+// shape is how the identities are lowered, see TargetMBAShape
+// vars_count is the variables per identity (2 to kMaxMBAVars), the operands
+// and random constants
+bool TransformBinaryOperatorBasicBlock(llvm::BasicBlock &BB, Random &rng, int mba_depth = 2, CostBudget *budget = nullptr, TransformStats *stats = nullptr,
+                                       const MBAShape &shape = MBAShape(), int vars_count = 3);
+// integer constant operands of the whole function, except those in skip
+// blocks, are replaced by MBA expressions pooled once per function or loop
+// nest.  the pools are new blocks
+bool TransformIntegerConstants(llvm::Function &F, Random &rng, CostBudget *budget = nullptr, TransformStats *stats = nullptr,
+                               const llvm::SmallPtrSetImpl<const llvm::BasicBlock *> *skip = nullptr, const MBAShape &shape = MBAShape(), int vars_count = 3);
+// with a budget the blocks flattening adds get weights: split blocks their
+// origin's, dispatchers the sum of the blocks that jump to them
+bool TransformFlatten(llvm::Function &F, Random &rng, FlattenMode mode = FlattenMode::kSSA, CostBudget *budget = nullptr, TransformStats *stats = nullptr);
+// kIndirectBr appends a table per function, this moves them to the end of
+// the module's globals sorted by name so the module does not depend on the
+// order its functions were flattened in.  once per module, after flattening
+void SortDispatchTables(llvm::Module &M);
 
 }  // namespace obfus
 
@@ -0,0 +1,26 @@
+#!/bin/sh
+set -eux
+
+CFLAGS="-fno-rtti -std=c++17"
+CFLAGS="$CFLAGS -Wall -Wextra -Wstrict-prototypes -pedantic -Wno-unused-parameter"
+CFLAGS="$CFLAGS -O2 -march=native"
+LLVM_FLAGS="$(llvm-config-11 --cxxflags --ldflags --libs core irreader orcjit native passes all-targets)"
+SOURCES="CostBudget.cpp DeriveZeroMBA.cpp MBABuilder.cpp Nullspace.cpp Transforms.cpp"
+
+# kernels are optimized before flattening, the same as running the pass at the optimizer-last extension point
+clang-11 -S -emit-llvm -O2 -std=c89 bench/kernels.c -o bench/kernels.ll
+clang-11 -S -emit-llvm -std=c89 test/test.c -o bench/test.ll
+
+clang++-11 bench/mba_bench.cpp $SOURCES $LLVM_FLAGS -o bench/mba_bench $CFLAGS
+clang++-11 bench/flatten_bench.cpp $SOURCES $LLVM_FLAGS -o bench/flatten_bench $CFLAGS
+clang++-11 bench/flatten_stress.cpp $SOURCES $LLVM_FLAGS -o bench/flatten_stress $CFLAGS
+clang++-11 bench/vector_bench.cpp $SOURCES $LLVM_FLAGS -o bench/vector_bench $CFLAGS
+clang++-11 bench/jit_bench.cpp jit/ObfusJIT.cpp Obfus.cpp Selection.cpp Cache.cpp $SOURCES $LLVM_FLAGS $(llvm-config-11 --libs bitreader bitwriter transformutils) -o bench/jit_bench $CFLAGS -pthread
+
+./bench/mba_bench
+./bench/flatten_bench bench/kernels.ll 200
+./bench/flatten_bench bench/kernels.ll 200 -O2
+./bench/flatten_bench bench/test.ll
+./bench/flatten_stress 100000
+./bench/vector_bench
+./bench/jit_bench bench/kernels.ll
@@ -0,0 +1,33 @@
+#!/bin/sh
+# obfus-driver wall time against thread count on one module of many random
+# functions (a stand-in for a unity build or a full LTO link), next to opt
+# running the pass on one thread.  every thread count has to give the same
+# bitcode
+# run from the repository root after build.sh
+set -eux
+
+FUNCTIONS=${FUNCTIONS:-400}
+SIZE=${SIZE:-300}
+
+now() {
+    date +%s.%N
+}
+
+mkdir -p bench/driver_parts
+for i in $(seq 1 $FUNCTIONS); do
+    llvm-stress-11 -seed=$i -size=$SIZE -o bench/driver_parts/f$i.ll
+done
+llvm-link-11 bench/driver_parts/*.ll -o bench/driver_module.bc
+
+start=$(now)
+opt-11 -load-pass-plugin=./obfus.so -passes=obfus bench/driver_module.bc -o bench/driver_opt.bc
+end=$(now)
+echo "tool=opt threads=1 seconds=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')"
+
+for threads in 1 2 4 8 16 $(nproc); do
+    start=$(now)
+    ./obfus-driver bench/driver_module.bc -o bench/driver_$threads.bc -j $threads
+    end=$(now)
+    echo "tool=obfus-driver threads=$threads seconds=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')"
+    cmp bench/driver_1.bc bench/driver_$threads.bc
+done
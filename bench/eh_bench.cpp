@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+/*
+Cost of flattening C++ code that uses exceptions, on the path that does not
+throw and on the one that does.  Every kernel calls checked() n times, which
+throws once its argument reaches limit: with limit = n nothing is thrown,
+with limit = 0 every call throws.  Prints one key=value line per kernel and
+path with the best of [repetitions] runs in ns per call and the result,
+which has to be the same for every build.  main is not obfuscated (the
+default config skips it), bench/eh_bench.sh builds it with each mode.
+usage: eh_bench <n> [repetitions]
+*/
+
+static uint64_t __attribute__((noinline)) checked(const uint64_t x, const uint64_t limit) {
+    if (x >= limit) {
+        throw std::out_of_range("checked");
+    }
+    return (x * 2654435761u) >> 7;
+}
+
+// try block in the loop, the exception is caught where it is thrown from
+static uint64_t __attribute__((noinline)) bench_try_loop(const uint64_t n, const uint64_t limit) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        try {
+            sum += checked(i, limit);
+        } catch (const std::out_of_range &) {
+            sum += i * 3;
+        }
+    }
+    return sum;
+}
+
+struct Counter {
+    uint64_t &count;
+    ~Counter() {
+        count++;
+    }
+};
+
+// a destructor on the way out, so the exception passes a cleanup pad
+static uint64_t __attribute__((noinline)) guarded(const uint64_t x, const uint64_t limit, uint64_t &count) {
+    Counter counter{count};
+    return checked(x, limit) + checked(x + 1, limit + 1);
+}
+
+// the exception crosses guarded's frame before it is caught
+static uint64_t __attribute__((noinline)) bench_cleanup(const uint64_t n, const uint64_t limit) {
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        try {
+            sum += guarded(i, limit, count);
+        } catch (...) {
+            sum += 3;
+        }
+    }
+    return sum + count;
+}
+
+struct Kernel {
+    const char *name;
+    uint64_t (*run)(uint64_t, uint64_t);
+};
+
+static const Kernel kKernels[] = {
+    {"bench_try_loop", bench_try_loop},
+    {"bench_cleanup", bench_cleanup},
+};
+
+int main(const int argc, const char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <n> [repetitions]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const uint64_t n = strtoull(argv[1], nullptr, 10);
+    const int repetitions = (argc > 2) ? atoi(argv[2]) : 5;
+    for (const auto &kernel : kKernels) {
+        for (const bool throws : {false, true}) {
+            const uint64_t limit = (throws) ? 0 : n;
+            double best = 0;
+            uint64_t result = 0;
+            for (int i = 0; i < repetitions; i++) {
+                const auto start = std::chrono::steady_clock::now();
+                result = kernel.run(n, limit);
+                const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+                best = (i == 0 || elapsed.count() < best) ? elapsed.count() : best;
+            }
+            printf("kernel=%s path=%s ns_per_call=%.2f result=%llu\n", kernel.name, (throws) ? "throw" : "normal", best / n,
+                   static_cast<unsigned long long>(result));
+        }
+    }
+    return EXIT_SUCCESS;
+}
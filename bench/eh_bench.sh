@@ -0,0 +1,36 @@
+#!/bin/sh
+# cost of flattening C++ code that uses exceptions (bench/eh_bench.cpp), on
+# the path that does not throw and on the one that does, unobfuscated and
+# with each flattening mode.  one line per build, kernel and path:
+#   build=<name> kernel=<name> path=normal|throw ns_per_call=<best of REPETITIONS> result=<n>
+# every build has to compute what plain does
+# run from the repository root after build.sh
+set -eux
+
+CXXFLAGS="-O2 -std=c++11"
+# -load registers the plugin's options so -mllvm can see them
+PLUGIN="-fexperimental-new-pass-manager -fpass-plugin=./obfus.so -Xclang -load -Xclang ./obfus.so"
+N=${N:-100000}
+REPETITIONS=${REPETITIONS:-5}
+
+# build=<name>:<-obfus-pipeline parameters>, plain builds without the plugin.
+# mba-depth=0 so the numbers are about the dispatch
+for config in \
+    "plain:" \
+    "flatten_ssa:flatten=ssa;mba-depth=0" \
+    "flatten_reg2mem:flatten=reg2mem;mba-depth=0" \
+    "flatten_indirectbr:flatten=indirectbr;mba-depth=0" \
+    "flatten_loops:flatten=loops;mba-depth=0"; do
+    build=${config%%:*}
+    params=${config#*:}
+    flags=""
+    if [ "$build" != "plain" ]; then
+        flags="$PLUGIN -mllvm -obfus-pipeline=$params"
+    fi
+    binary=bench/eh_bench_$build
+    clang++-11 bench/eh_bench.cpp -o $binary $CXXFLAGS $flags
+
+    $binary $N $REPETITIONS | sed "s/^/build=$build /" | tee $binary.txt
+    sed 's/^build=[^ ]* \(kernel=[^ ]* path=[^ ]*\) .* \(result=[^ ]*\)$/\1 \2/' $binary.txt > $binary.results
+    cmp bench/eh_bench_plain.results $binary.results
+done
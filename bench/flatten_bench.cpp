@@ -0,0 +1,215 @@
+/*
+Runtime benchmark for the flattening modes.
+Every defined function except main is flattened with TransformFlatten (no
+MBA) in each mode, the module is compiled with LLJIT and every entry point
+is timed.  A second, instrumented copy counts the IR level loads and stores
+executed by the flattened functions (spills added by codegen are not
+included).
+Entry points are the uint64_t bench_<name>(uint64_t n) kernels from
+bench/kernels.c, or int main(void) for modules without any (test/test.c).
+With -O2 the default O2 pipeline runs after flattening, which is what
+happens when the pass is scheduled at the pipeline start, and shows how
+much of each mode later optimizations can still work with (loops mode keeps
+innermost loops for LICM and the vectorizers).
+usage: flatten_bench <module.ll|module.bc> [n] [-O2]
+*/
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../Random.hpp"
+#include "../Transforms.hpp"
+
+static const constexpr int kRepetitions = 3;
+
+struct Mode {
+    const char *name;
+    bool flatten;
+    obfus::FlattenMode mode;
+};
+
+static const Mode kModes[] = {
+    {"none", false, obfus::FlattenMode::kSSA},
+    {"reg2mem", true, obfus::FlattenMode::kReg2Mem},
+    {"ssa", true, obfus::FlattenMode::kSSA},
+    {"indirectbr", true, obfus::FlattenMode::kIndirectBr},
+    {"loops", true, obfus::FlattenMode::kLoops},
+};
+
+static std::unique_ptr<llvm::Module> LoadModule(const char *path, llvm::LLVMContext &context) {
+    llvm::SMDiagnostic error;
+    auto module = llvm::parseIRFile(path, error, context);
+    if (!module) {
+        error.print("flatten_bench", llvm::errs());
+        std::exit(EXIT_FAILURE);
+    }
+    return module;
+}
+
+// count every load and store of the flattened functions in two globals
+static void InstrumentMemoryOperations(llvm::Module &M) {
+    const auto int64_type = llvm::Type::getInt64Ty(M.getContext());
+    const auto make_counter = [&](const char *name) {
+        return new llvm::GlobalVariable(M, int64_type, false, llvm::GlobalValue::ExternalLinkage, llvm::ConstantInt::get(int64_type, 0), name);
+    };
+    const auto loads = make_counter("obfus_bench_loads");
+    const auto stores = make_counter("obfus_bench_stores");
+
+    std::vector<llvm::Instruction *> memory_operations;
+    for (auto &F : M) {
+        if (F.isDeclaration() || F.getName() == "main") {
+            continue;
+        }
+        for (auto &BB : F) {
+            for (auto &I : BB) {
+                if (llvm::isa<llvm::LoadInst>(I) || llvm::isa<llvm::StoreInst>(I)) {
+                    memory_operations.emplace_back(&I);
+                }
+            }
+        }
+    }
+    for (const auto I : memory_operations) {
+        llvm::IRBuilder<> builder(I);
+        const auto counter = llvm::isa<llvm::LoadInst>(I) ? loads : stores;
+        builder.CreateStore(builder.CreateAdd(builder.CreateLoad(int64_type, counter), builder.getInt64(1)), counter);
+    }
+}
+
+struct Result {
+    double seconds;
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t value;
+};
+
+static std::unique_ptr<llvm::orc::LLJIT> BuildJIT(std::unique_ptr<llvm::Module> module, std::unique_ptr<llvm::LLVMContext> context) {
+    auto jit = llvm::cantFail(llvm::orc::LLJITBuilder().create());
+    jit->getMainJITDylib().addGenerator(llvm::cantFail(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix())));
+    llvm::cantFail(jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+    return jit;
+}
+
+static void Optimize(llvm::Module &M) {
+    llvm::PassBuilder PB;
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+#if LLVM_VERSION_MAJOR >= 13
+    PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2).run(M, MAM);
+#else
+    PB.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O2).run(M, MAM);
+#endif
+}
+
+// flatten (optionally optimize and instrument) a fresh copy of the module,
+// then JIT it
+static std::unique_ptr<llvm::orc::LLJIT> Prepare(const char *path, const Mode &mode, const bool optimize, const bool instrument) {
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = LoadModule(path, *context);
+    if (mode.flatten) {
+        for (auto &F : *module) {
+            if (!F.isDeclaration() && F.getName() != "main") {
+                auto rng = obfus::Random::ForFunction(obfus::kDefaultSeed, F.getName());
+                obfus::TransformFlatten(F, rng, mode.mode);
+            }
+        }
+    }
+    if (optimize) {
+        Optimize(*module);
+    }
+    if (instrument) {
+        InstrumentMemoryOperations(*module);
+    }
+    return BuildJIT(std::move(module), std::move(context));
+}
+
+static uint64_t Call(const llvm::JITTargetAddress address, const std::string &entry, const uint64_t n) {
+    if (entry == "main") {
+        return reinterpret_cast<int (*)(void)>(address)();
+    }
+    return reinterpret_cast<uint64_t (*)(uint64_t)>(address)(n);
+}
+
+static uint64_t ReadCounter(llvm::orc::LLJIT &jit, const char *name) {
+    return *reinterpret_cast<uint64_t *>(llvm::cantFail(jit.lookup(name)).getAddress());
+}
+
+int main(const int argc, const char **argv) {
+    if (argc < 2) {
+        llvm::errs() << "usage: " << argv[0] << " <module> [n] [-O2]\n";
+        return EXIT_FAILURE;
+    }
+    const uint64_t n = (argc > 2) ? std::strtoull(argv[2], nullptr, 10) : 1000;
+    const bool optimize = (argc > 3) && std::string(argv[3]) == "-O2";
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    std::vector<std::string> entries;
+    {
+        llvm::LLVMContext context;
+        const auto module = LoadModule(argv[1], context);
+        for (auto &F : *module) {
+            if (!F.isDeclaration() && F.getName().startswith("bench_")) {
+                entries.emplace_back(F.getName().str());
+            }
+        }
+        if (entries.empty()) {
+            entries.emplace_back("main");
+        }
+    }
+
+    for (const auto &mode : kModes) {
+        auto jit = Prepare(argv[1], mode, optimize, false);
+        auto counting_jit = Prepare(argv[1], mode, optimize, true);
+        for (const auto &entry : entries) {
+            // lookups compile the module, keep that out of the timings
+            const auto address = llvm::cantFail(jit->lookup(entry)).getAddress();
+            const auto counting_address = llvm::cantFail(counting_jit->lookup(entry)).getAddress();
+
+            Result result{1e100, 0, 0, 0};
+            for (int i = 0; i < kRepetitions; i++) {
+                const auto start = std::chrono::steady_clock::now();
+                result.value = Call(address, entry, n);
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                result.seconds = std::min(result.seconds, elapsed.count());
+            }
+
+            const uint64_t loads_before = ReadCounter(*counting_jit, "obfus_bench_loads");
+            const uint64_t stores_before = ReadCounter(*counting_jit, "obfus_bench_stores");
+            if (Call(counting_address, entry, n) != result.value) {
+                llvm::errs() << entry << ": instrumented result differs\n";
+                return EXIT_FAILURE;
+            }
+            result.loads = ReadCounter(*counting_jit, "obfus_bench_loads") - loads_before;
+            result.stores = ReadCounter(*counting_jit, "obfus_bench_stores") - stores_before;
+
+            llvm::outs() << "kernel=" << entry << " mode=" << mode.name << " time_ms=" << llvm::format("%.3f", result.seconds * 1e3)
+                         << " loads=" << result.loads << " stores=" << result.stores << " result=" << result.value << "\n";
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+/*
+Compile time stress test for TransformFlatten.
+Builds synthetic state machine functions of 100 to 100k blocks (generated
+parsers look like this: every block updates some state and jumps either to
+the next block or somewhere else depending on the input), then times
+flattening them in each mode.  Every measurement runs in its own forked
+process so the reported peak RSS belongs to that size and mode alone.
+usage: flatten_stress [max_blocks]
+*/
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+
+#include "../Random.hpp"
+#include "../Transforms.hpp"
+
+struct Mode {
+    const char *name;
+    obfus::FlattenMode mode;
+};
+
+static const Mode kModes[] = {
+    {"reg2mem", obfus::FlattenMode::kReg2Mem},
+    {"ssa", obfus::FlattenMode::kSSA},
+    {"indirectbr", obfus::FlattenMode::kIndirectBr},
+    {"loops", obfus::FlattenMode::kLoops},
+};
+
+// i32 machine(i32 input) with blocks_count blocks, promoted to SSA so values
+// flow through phis like they would after clang -O1
+static llvm::Function *BuildStateMachine(llvm::Module &M, const int blocks_count) {
+    auto &context = M.getContext();
+    llvm::IRBuilder<> builder(context);
+    const auto int_type = builder.getInt32Ty();
+    const auto F = llvm::Function::Create(llvm::FunctionType::get(int_type, {int_type}, false),
+                                          llvm::Function::ExternalLinkage, "machine", M);
+    const auto input = F->getArg(0);
+
+    const auto entry = llvm::BasicBlock::Create(context, "entry", F);
+    std::vector<llvm::BasicBlock *> blocks;
+    for (int i = 0; i < blocks_count; i++) {
+        blocks.emplace_back(llvm::BasicBlock::Create(context, "state", F));
+    }
+    const auto exit = llvm::BasicBlock::Create(context, "exit", F);
+
+    builder.SetInsertPoint(entry);
+    const auto acc = builder.CreateAlloca(int_type);
+    const auto count = builder.CreateAlloca(int_type);
+    builder.CreateStore(input, acc);
+    builder.CreateStore(builder.getInt32(0), count);
+    builder.CreateBr(blocks.front());
+
+    obfus::Random rng(obfus::kDefaultSeed);
+    for (int i = 0; i < blocks_count; i++) {
+        builder.SetInsertPoint(blocks[i]);
+        llvm::Value *value = builder.CreateLoad(int_type, acc);
+        value = builder.CreateXor(builder.CreateAdd(value, builder.getInt32(i)), input);
+        builder.CreateStore(value, acc);
+        builder.CreateStore(builder.CreateAdd(builder.CreateLoad(int_type, count), builder.getInt32(1)), count);
+        const auto next = (i + 1 < blocks_count) ? blocks[i + 1] : exit;
+        const auto jump = blocks[rng.Uniform(blocks_count)];
+        builder.CreateCondBr(builder.CreateICmpULT(builder.CreateAnd(value, builder.getInt32(255)), builder.getInt32(192)), next, jump);
+    }
+    builder.SetInsertPoint(exit);
+    builder.CreateRet(builder.CreateAdd(builder.CreateLoad(int_type, acc), builder.CreateLoad(int_type, count)));
+
+    llvm::DominatorTree DT(*F);
+    llvm::PromoteMemToReg({acc, count}, DT);
+    return F;
+}
+
+static long PeakRSS() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void Measure(const int blocks_count, const Mode &mode) {
+    llvm::LLVMContext context;
+    llvm::Module module("flatten_stress", context);
+    const auto F = BuildStateMachine(module, blocks_count);
+    const size_t instructions = F->getInstructionCount();
+    const long rss_before = PeakRSS();
+
+    auto rng = obfus::Random::ForFunction(obfus::kDefaultSeed, F->getName());
+    const auto start = std::chrono::steady_clock::now();
+    obfus::TransformFlatten(*F, rng, mode.mode);
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    const bool broken = llvm::verifyFunction(*F, &llvm::errs());
+    llvm::outs() << "blocks=" << blocks_count << " instructions=" << instructions << " mode=" << mode.name
+                 << " time_ms=" << llvm::format("%.1f", elapsed.count()) << " peak_rss_kb=" << PeakRSS()
+                 << " rss_before_kb=" << rss_before << " verified=" << (broken ? "false" : "true") << "\n";
+    llvm::outs().flush();
+}
+
+int main(int argc, char **argv) {
+    const int max_blocks = (argc > 1) ? std::atoi(argv[1]) : 100000;
+    for (int blocks_count = 100; blocks_count <= max_blocks; blocks_count *= 10) {
+        for (const auto &mode : kModes) {
+            const pid_t pid = fork();
+            if (pid == 0) {
+                Measure(blocks_count, mode);
+                std::_Exit(EXIT_SUCCESS);
+            }
+            int status = 0;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                llvm::errs() << "blocks=" << blocks_count << " mode=" << mode.name << " failed\n";
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*
+Startup latency of load time re-obfuscation (jit/ObfusJIT.hpp).
+Each repetition parses the module again and builds four JITs on it:
+  eager_plain   LLJIT, the whole module compiled at the first lookup
+  eager_obfus   the same with ObfusTransform on the whole module
+  lazy_plain    LLLazyJIT, every function compiled on its first call
+  lazy_obfus    CreateObfusJIT, every function obfuscated and compiled on
+                its first call
+The obfuscating ones draw a fresh seed each time like separate processes
+would.  Reported are the setup (JIT and host TargetMachine creation, adding
+the module), the time to the first call of the first kernel, the time until
+every kernel has run once, and each kernel's first call split into the
+transform and the rest (codegen, linking, stubs).  Medians over the
+repetitions.  Kernels are the uint64_t bench_<name>(uint64_t n) functions of
+bench/kernels.c, called with n=1 so the calls cost next to nothing, and
+afterwards every kernel has to give what the eager plain JIT gives.
+usage: jit_bench <module.ll|module.bc> [repetitions]
+*/
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../jit/ObfusJIT.hpp"
+
+static const constexpr int kDefaultRepetitions = 5;
+// argument of the result check after the first calls
+static const constexpr uint64_t kCheckN = 100;
+
+struct JITKind {
+    const char *name;
+    bool lazy;
+    bool obfuscate;
+};
+
+static const JITKind kKinds[] = {
+    {"eager_plain", false, false},
+    {"eager_obfus", false, true},
+    {"lazy_plain", true, false},
+    {"lazy_obfus", true, true},
+};
+
+static llvm::orc::ThreadSafeModule LoadModule(const char *path) {
+    auto context = std::make_unique<llvm::LLVMContext>();
+    llvm::SMDiagnostic error;
+    auto module = llvm::parseIRFile(path, error, *context);
+    if (!module) {
+        error.print("jit_bench", llvm::errs());
+        std::exit(EXIT_FAILURE);
+    }
+    return llvm::orc::ThreadSafeModule(std::move(module), std::move(context));
+}
+
+static void AddProcessSymbols(llvm::orc::LLJIT &jit) {
+    jit.getMainJITDylib().addGenerator(llvm::cantFail(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit.getDataLayout().getGlobalPrefix())));
+}
+
+// a JIT of kind holding module, transform is only used by the obfuscating kinds
+static std::unique_ptr<llvm::orc::LLJIT> CreateJIT(const JITKind &kind, const obfus::ObfusTransform &transform, llvm::orc::ThreadSafeModule module) {
+    if (kind.lazy && kind.obfuscate) {
+        auto jit = llvm::cantFail(obfus::CreateObfusJIT(transform));
+        llvm::cantFail(jit->addLazyIRModule(std::move(module)));
+        return jit;
+    }
+    if (kind.lazy) {
+        auto jit = llvm::cantFail(llvm::orc::LLLazyJITBuilder().create());
+        jit->setPartitionFunction(llvm::orc::CompileOnDemandLayer::compileRequested);
+        AddProcessSymbols(*jit);
+        llvm::cantFail(jit->addLazyIRModule(std::move(module)));
+        return jit;
+    }
+    auto jit = llvm::cantFail(llvm::orc::LLJITBuilder().create());
+    if (kind.obfuscate) {
+        jit->getIRTransformLayer().setTransform(transform);
+    }
+    AddProcessSymbols(*jit);
+    llvm::cantFail(jit->addIRModule(std::move(module)));
+    return jit;
+}
+
+static uint64_t (*LookupKernel(llvm::orc::LLJIT &jit, const std::string &name))(uint64_t) {
+#if LLVM_VERSION_MAJOR >= 15
+    const auto address = llvm::cantFail(jit.lookup(name)).getValue();
+#else
+    const auto address = llvm::cantFail(jit.lookup(name)).getAddress();
+#endif
+    return reinterpret_cast<uint64_t (*)(uint64_t)>(address);
+}
+
+static double Milliseconds(const std::chrono::steady_clock::time_point start) {
+    const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static double Median(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+int main(const int argc, const char **argv) {
+    if (argc < 2) {
+        llvm::errs() << "usage: " << argv[0] << " <module> [repetitions]\n";
+        return EXIT_FAILURE;
+    }
+    const int repetitions = (argc > 2) ? std::max(1, std::atoi(argv[2])) : kDefaultRepetitions;
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    std::vector<std::string> kernels;
+    {
+        const auto module = LoadModule(argv[1]);
+        module.withModuleDo([&](llvm::Module &M) {
+            for (const auto &F : M) {
+                if (!F.isDeclaration() && F.getName().startswith("bench_")) {
+                    kernels.emplace_back(F.getName().str());
+                }
+            }
+        });
+    }
+    if (kernels.empty()) {
+        llvm::errs() << argv[1] << ": no bench_<name> kernels\n";
+        return EXIT_FAILURE;
+    }
+
+    // samples per "<jit> <what>" key, expected results from eager_plain
+    std::map<std::string, std::vector<double>> samples;
+    std::map<std::string, uint64_t> expected;
+    for (int repetition = 0; repetition < repetitions; repetition++) {
+        for (const auto &kind : kKinds) {
+            auto module = LoadModule(argv[1]);
+            const std::string prefix = std::string(kind.name) + " ";
+
+            const auto setup_start = std::chrono::steady_clock::now();
+            obfus::ObfusOptions options;
+            options.seed = obfus::ProcessSeed();
+            obfus::ObfusTransform transform(options, (kind.obfuscate) ? llvm::cantFail(obfus::HostTargetMachine()) : nullptr);
+            const auto jit = CreateJIT(kind, transform, std::move(module));
+            const double setup = Milliseconds(setup_start);
+            samples[prefix + "setup"].emplace_back(setup);
+
+            double elapsed = setup;
+            for (const auto &kernel : kernels) {
+                const uint64_t transform_before = transform.Nanoseconds();
+                const auto call_start = std::chrono::steady_clock::now();
+                LookupKernel(*jit, kernel)(1);
+                const double first_call = Milliseconds(call_start);
+                const double transform_ms = (transform.Nanoseconds() - transform_before) / 1e6;
+                samples[prefix + kernel + " first_call"].emplace_back(first_call);
+                samples[prefix + kernel + " transform"].emplace_back(transform_ms);
+                if (kernel == kernels.front()) {
+                    samples[prefix + "time_to_first_call"].emplace_back(elapsed + first_call);
+                }
+                elapsed += first_call;
+            }
+            samples[prefix + "all_called"].emplace_back(elapsed);
+
+            for (const auto &kernel : kernels) {
+                const uint64_t result = LookupKernel(*jit, kernel)(kCheckN);
+                const auto found = expected.emplace(kernel, result);
+                if (found.first->second != result) {
+                    llvm::errs() << kind.name << ": " << kernel << " returned " << result << " instead of " << found.first->second << "\n";
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    for (const auto &kind : kKinds) {
+        const std::string prefix = std::string(kind.name) + " ";
+        llvm::outs() << "jit=" << kind.name << " setup_ms=" << llvm::format("%.3f", Median(samples[prefix + "setup"]))
+                     << " time_to_first_call_ms=" << llvm::format("%.3f", Median(samples[prefix + "time_to_first_call"]))
+                     << " all_called_ms=" << llvm::format("%.3f", Median(samples[prefix + "all_called"])) << "\n";
+        for (const auto &kernel : kernels) {
+            const double first_call = Median(samples[prefix + kernel + " first_call"]);
+            const double transform = Median(samples[prefix + kernel + " transform"]);
+            llvm::outs() << "jit=" << kind.name << " kernel=" << kernel << " first_call_ms=" << llvm::format("%.3f", first_call)
+                         << " transform_ms=" << llvm::format("%.3f", transform) << " rest_ms=" << llvm::format("%.3f", std::max(0.0, first_call - transform)) << "\n";
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+#include <stdint.h>
+#include <string.h>
+
+/*
+Loop heavy kernels for the runtime benchmarks.
+Every kernel is exported as uint64_t bench_<name>(uint64_t n) so the
+benchmark drivers can find and call them, n scales the amount of work.
+*/
+
+static uint8_t buffer[4096];
+static uint32_t sieve[8192 / 32];
+static int32_t matrix_a[16][16], matrix_b[16][16], matrix_c[16][16];
+static char text[4096];
+
+static void fill_buffer(uint64_t seed) {
+    unsigned int i;
+    for (i = 0; i < sizeof(buffer); i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (uint8_t)(seed >> 56);
+    }
+}
+
+uint64_t bench_fnv1a(uint64_t n) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t round;
+    unsigned int i;
+    fill_buffer(n);
+    for (round = 0; round < n; round++) {
+        for (i = 0; i < sizeof(buffer); i++) {
+            hash ^= buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+uint64_t bench_crc32(uint64_t n) {
+    uint32_t crc = 0xFFFFFFFFu;
+    uint64_t round;
+    unsigned int i, bit;
+    fill_buffer(n);
+    for (round = 0; round < n; round++) {
+        for (i = 0; i < sizeof(buffer); i++) {
+            crc ^= buffer[i];
+            for (bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+            }
+        }
+    }
+    return ~crc;
+}
+
+uint64_t bench_sieve(uint64_t n) {
+    uint64_t count = 0, round;
+    unsigned int i, j;
+    for (round = 0; round < n; round++) {
+        memset(sieve, 0, sizeof(sieve));
+        for (i = 2; i * i < 8192; i++) {
+            if (!(sieve[i / 32] & (1u << (i % 32)))) {
+                for (j = i * i; j < 8192; j += i) {
+                    sieve[j / 32] |= 1u << (j % 32);
+                }
+            }
+        }
+        for (i = 2; i < 8192; i++) {
+            count += !(sieve[i / 32] & (1u << (i % 32)));
+        }
+    }
+    return count;
+}
+
+/* counts identifiers, numbers and operators in a synthetic token stream */
+uint64_t bench_state_machine(uint64_t n) {
+    enum { kStart, kIdentifier, kNumber, kOperator } state = kStart;
+    uint64_t tokens = 0, round;
+    unsigned int i;
+    fill_buffer(n);
+    for (round = 0; round < n; round++) {
+        for (i = 0; i < sizeof(buffer); i++) {
+            const uint8_t c = buffer[i] & 0x7F;
+            switch (state) {
+                case kStart:
+                    if (c >= 'a' && c <= 'z') {
+                        state = kIdentifier;
+                    } else if (c >= '0' && c <= '9') {
+                        state = kNumber;
+                    } else if (c == '+' || c == '-' || c == '*' || c == '/') {
+                        state = kOperator;
+                    }
+                    break;
+                case kIdentifier:
+                    if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))) {
+                        tokens++;
+                        state = kStart;
+                    }
+                    break;
+                case kNumber:
+                    if (!(c >= '0' && c <= '9')) {
+                        tokens++;
+                        state = kStart;
+                    }
+                    break;
+                case kOperator:
+                    tokens++;
+                    state = kStart;
+                    break;
+            }
+        }
+    }
+    return tokens;
+}
+
+/* sums the comma separated, optionally negative decimal fields of every
+   line of a synthetic CSV file, the inner loop of a number parser */
+uint64_t bench_parse(uint64_t n) {
+    uint64_t checksum = 0, seed = n, round;
+    unsigned int i;
+    for (i = 0; i < sizeof(text) - 1; i++) {
+        unsigned int r;
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        r = (unsigned int)(seed >> 59);
+        text[i] = (r < 22) ? (char)('0' + r % 10) : (r < 26) ? ',' : (r < 28) ? '\n' : (r < 30) ? '-' : ' ';
+    }
+    text[sizeof(text) - 1] = '\0';
+    for (round = 0; round < n; round++) {
+        uint64_t value = 0, line = 0;
+        int negative = 0, digits = 0;
+        for (i = 0; text[i] != '\0'; i++) {
+            const char c = text[i];
+            if (c >= '0' && c <= '9') {
+                value = value * 10 + (uint64_t)(c - '0');
+                digits++;
+            } else if (c == '-' && digits == 0) {
+                negative = !negative;
+            } else if (c == ',' || c == '\n') {
+                line += (negative) ? 0 - value : value;
+                value = 0;
+                negative = 0;
+                digits = 0;
+                if (c == '\n') {
+                    checksum = checksum * 31 + line;
+                    line = 0;
+                }
+            }
+        }
+        checksum += line + round;
+    }
+    return checksum;
+}
+
+uint64_t bench_matmul(uint64_t n) {
+    uint64_t checksum = 0, round;
+    unsigned int i, j, k;
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 16; j++) {
+            matrix_a[i][j] = (int32_t)(i * 16 + j);
+            matrix_b[i][j] = (int32_t)(j * 16 + i);
+        }
+    }
+    for (round = 0; round < n; round++) {
+        for (i = 0; i < 16; i++) {
+            for (j = 0; j < 16; j++) {
+                int32_t sum = 0;
+                for (k = 0; k < 16; k++) {
+                    sum += matrix_a[i][k] * matrix_b[k][j];
+                }
+                matrix_c[i][j] = sum;
+            }
+        }
+        matrix_a[round % 16][round % 16] ^= matrix_c[15][15];
+        checksum += (uint32_t)matrix_c[round % 16][0];
+    }
+    return checksum;
+}
+
+uint64_t bench_collatz(uint64_t n) {
+    uint64_t steps = 0, start;
+    for (start = 1; start < n * 64; start++) {
+        uint64_t x = start;
+        while (x != 1) {
+            x = (x & 1) ? (3 * x + 1) : (x >> 1);
+            steps++;
+        }
+    }
+    return steps;
+}
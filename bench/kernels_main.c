@@ -0,0 +1,125 @@
+#ifdef __linux__
+/* syscall() */
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+Native driver for bench/kernels.c: runs every kernel with the n given on the
+command line (the best of [repetitions] runs) and prints one key=value line
+per kernel with the wall time and, where perf events are available, the
+user space instructions retired ("na" otherwise).
+usage: kernels <n> [repetitions]
+*/
+
+uint64_t bench_fnv1a(uint64_t n);
+uint64_t bench_crc32(uint64_t n);
+uint64_t bench_sieve(uint64_t n);
+uint64_t bench_state_machine(uint64_t n);
+uint64_t bench_parse(uint64_t n);
+uint64_t bench_matmul(uint64_t n);
+uint64_t bench_collatz(uint64_t n);
+
+struct kernel {
+    const char *name;
+    uint64_t (*run)(uint64_t);
+};
+
+static const struct kernel kernels[] = {
+    {"bench_fnv1a", bench_fnv1a},
+    {"bench_crc32", bench_crc32},
+    {"bench_sieve", bench_sieve},
+    {"bench_state_machine", bench_state_machine},
+    {"bench_parse", bench_parse},
+    {"bench_matmul", bench_matmul},
+    {"bench_collatz", bench_collatz},
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* counts this thread's user space instructions, -1 without perf events
+   (other systems, containers, perf_event_paranoid) */
+static int open_instruction_counter(void) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void start_counter(int fd) {
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static uint64_t stop_counter(int fd) {
+    uint64_t count = 0;
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = 0;
+        }
+    }
+#endif
+    return count;
+}
+
+int main(int argc, char **argv) {
+    const uint64_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200;
+    const unsigned long repetitions = (argc > 2 && strtoul(argv[2], NULL, 10) > 0) ? strtoul(argv[2], NULL, 10) : 1;
+    const int counter = open_instruction_counter();
+    unsigned int i;
+    unsigned long repetition;
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        double best_ms = 0;
+        uint64_t instructions = 0, result = 0;
+        char instructions_text[32] = "na";
+        for (repetition = 0; repetition < repetitions; repetition++) {
+            double start, elapsed;
+            uint64_t count;
+            start_counter(counter);
+            start = now_ms();
+            result = kernels[i].run(n);
+            elapsed = now_ms() - start;
+            count = stop_counter(counter);
+            if (repetition == 0 || elapsed < best_ms) {
+                best_ms = elapsed;
+            }
+            if (repetition == 0 || count < instructions) {
+                instructions = count;
+            }
+        }
+        if (counter >= 0) {
+            sprintf(instructions_text, "%lu", (unsigned long)instructions);
+        }
+        printf("kernel=%s time_ms=%.3f instructions=%s result=%lu\n", kernels[i].name, best_ms, instructions_text, (unsigned long)result);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/*
+Microbenchmark for GenerateRandomMBAIdentity.
+Emits identities into a scratch function and reports identities per second
+for every MBASource, then the cost per identity of the nullspace solver as
+the variable count grows, alone and through TransformBinaryOperatorBasicBlock
+with mba-vars 2-8.  The block is cleared periodically so memory use stays
+flat and we measure generation rather than allocator growth.
+It reports the IR size of a block of rewritten binary operators with and
+without sharing subterms through MBABuilder.  Finally, for a few targets and
+types, it compares the lowering shapes (chain, balanced, target): the critical
+path of an identity in TTI latency and its size in machine instructions
+after codegen.
+*/
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/MC/TargetRegistry.h>
+#else
+#include <llvm/Support/TargetRegistry.h>
+#endif
+#include <llvm/Support/Format.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "../DeriveZeroMBA.hpp"
+#include "../Transforms.hpp"
+
+static const constexpr int kIdentities = 200000;
+static const constexpr int kClearInterval = 1024;
+static const constexpr int kMaxBenchVars = 8;
+// binary operators per block in the IR size comparison, each gets 2
+// identities like TransformBinaryOperatorBasicBlock does
+static const constexpr int kBlockOperators = 1000;
+// identities per target, type and shape in the lowering comparison, each in
+// its own function
+static const constexpr int kShapeIdentities = 64;
+
+struct BenchTarget {
+    const char *name;
+    const char *triple;
+    const char *cpu;
+    const char *features;
+};
+
+static const BenchTarget kTargets[] = {
+    {"x86-64", "x86_64-unknown-linux-gnu", "x86-64", "+sse2"},
+    {"haswell", "x86_64-unknown-linux-gnu", "haswell", "+sse2,+avx,+avx2,+bmi,+bmi2"},
+    {"skylake-avx512", "x86_64-unknown-linux-gnu", "skylake-avx512", "+sse2,+avx,+avx2,+bmi,+bmi2,+avx512f,+avx512vl,+avx512bw,+avx512dq"},
+    {"aarch64", "aarch64-unknown-linux-gnu", "generic", "+neon"},
+};
+
+static double IdentitiesPerSecond(llvm::Function &F, obfus::Random &rng, const std::vector<llvm::Value *> &vars, const obfus::MBASource source) {
+    const auto BB = llvm::BasicBlock::Create(F.getContext(), "bench", &F);
+    llvm::IRBuilder<> ir_builder(BB);
+    obfus::MBABuilder builder(ir_builder);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIdentities; i++) {
+        if (i % kClearInterval == 0) {
+            while (!BB->empty()) {
+                BB->back().eraseFromParent();
+            }
+            builder.Reset();
+            ir_builder.SetInsertPoint(BB);
+        }
+        obfus::GenerateRandomMBAIdentity(builder, rng, vars.front()->getType(), vars, source);
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    BB->eraseFromParent();
+    return kIdentities / elapsed.count();
+}
+
+// instructions emitted for kBlockOperators rewrites whose variables are
+// vars_count - 1 random constants and one of the function arguments
+static size_t BlockSize(llvm::Function &F, const std::vector<llvm::Value *> &args, const int vars_count, const bool hash_cons) {
+    const auto BB = llvm::BasicBlock::Create(F.getContext(), "bench", &F);
+    llvm::IRBuilder<> ir_builder(BB);
+    obfus::MBABuilder builder(ir_builder, hash_cons);
+    const auto type = args.front()->getType();
+
+    // same stream for both runs so they build the same identities
+    obfus::Random rng(obfus::kDefaultSeed);
+    for (int i = 0; i < kBlockOperators; i++) {
+        std::vector<llvm::Value *> vars{llvm::ConstantInt::get(type, rng.Uniform(255)), args[i % args.size()]};
+        while (static_cast<int>(vars.size()) < vars_count) {
+            vars.emplace_back(llvm::ConstantInt::get(type, rng.Uniform(255)));
+        }
+        for (int identity = 0; identity < 2; identity++) {
+            obfus::GenerateRandomMBAIdentity(builder, rng, type, vars);
+        }
+    }
+    const auto size = BB->size();
+
+    BB->eraseFromParent();
+    return size;
+}
+
+// a chain of kBlockOperators adds of the arguments rewritten with identities
+// over vars_count variables, as the pass does with mba-vars.  microseconds
+// and IR instructions per identity
+static std::pair<double, double> RewriteCost(llvm::Function &F, const std::vector<llvm::Value *> &args, const int vars_count) {
+    const auto BB = llvm::BasicBlock::Create(F.getContext(), "bench", &F);
+    llvm::IRBuilder<> ir_builder(BB);
+    llvm::Value *sum = args.front();
+    for (int i = 0; i < kBlockOperators; i++) {
+        sum = ir_builder.CreateAdd(sum, args[(i + 1) % args.size()]);
+    }
+    ir_builder.CreateRet(sum);
+    const auto before = BB->size();
+
+    obfus::Random rng(obfus::kDefaultSeed);
+    obfus::TransformStats stats;
+    const auto start = std::chrono::steady_clock::now();
+    obfus::TransformBinaryOperatorBasicBlock(*BB, rng, 2, nullptr, &stats, obfus::MBAShape(), vars_count);
+    const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    const auto identities = static_cast<double>(stats.mba.identities);
+    const auto added = static_cast<double>(BB->size()) - before;
+
+    BB->eraseFromParent();
+    return {elapsed.count() / identities, added / identities};
+}
+
+// instructions the target can not cost are counted as 1
+static int64_t Latency(const llvm::TargetTransformInfo &TTI, const llvm::Instruction &I) {
+#if LLVM_VERSION_MAJOR >= 12
+    const auto cost = TTI.getInstructionCost(&I, llvm::TargetTransformInfo::TCK_Latency);
+    return cost.isValid() ? std::max<int64_t>(*cost.getValue(), 0) : 1;
+#else
+    const int cost = TTI.getInstructionCost(&I, llvm::TargetTransformInfo::TCK_Latency);
+    return (cost >= 0) ? cost : 1;
+#endif
+}
+
+// longest chain of TTI latencies from the arguments to F's return value
+static int64_t CriticalPath(const llvm::TargetTransformInfo &TTI, const llvm::Function &F) {
+    llvm::DenseMap<const llvm::Value *, int64_t> depth;
+    int64_t path = 0;
+    for (const auto &I : F.getEntryBlock()) {
+        int64_t operands = 0;
+        for (const auto &operand : I.operands()) {
+            operands = std::max(operands, depth.lookup(operand.get()));
+        }
+        depth[&I] = operands + Latency(TTI, I);
+        path = std::max(path, operands);
+    }
+    return path;
+}
+
+// machine instructions in the assembly for M, directives and labels aside
+static size_t AsmInstructions(llvm::TargetMachine &TM, llvm::Module &M) {
+    llvm::SmallString<0> assembly;
+    llvm::raw_svector_ostream stream(assembly);
+    llvm::legacy::PassManager PM;
+#if LLVM_VERSION_MAJOR >= 18
+    const auto file_type = llvm::CodeGenFileType::AssemblyFile;
+#else
+    const auto file_type = llvm::CGFT_AssemblyFile;
+#endif
+    if (TM.addPassesToEmitFile(PM, stream, nullptr, file_type)) {
+        return 0;
+    }
+    PM.run(M);
+    size_t count = 0;
+    llvm::StringRef rest = assembly.str();
+    while (!rest.empty()) {
+        llvm::StringRef line;
+        std::tie(line, rest) = rest.split('\n');
+        line = line.ltrim();
+        if (!line.empty() && line.front() != '.' && line.front() != '#' && !line.startswith("//") && !line.endswith(":")) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// kShapeIdentities functions <type> f(<type> x, <type> y, <type> z) returning
+// one identity over x y z each, prints the mean critical path and machine
+// instructions per identity less the return
+static void CompareShapes(const BenchTarget &target, llvm::TargetMachine &TM, llvm::Type *(*get_type)(llvm::LLVMContext &), const char *type_name) {
+    for (const auto shape_name : {"chain", "balanced", "target"}) {
+        llvm::LLVMContext context;
+        llvm::Module module("mba_shapes", context);
+        module.setTargetTriple(target.triple);
+        module.setDataLayout(TM.createDataLayout());
+        const auto type = get_type(context);
+
+        obfus::Random rng(obfus::kDefaultSeed);
+        int64_t path = 0;
+        for (int i = 0; i < kShapeIdentities; i++) {
+            const auto F = llvm::Function::Create(llvm::FunctionType::get(type, {type, type, type}, false),
+                                                  llvm::Function::ExternalLinkage, "identity" + std::to_string(i), module);
+            F->addFnAttr("target-cpu", target.cpu);
+            F->addFnAttr("target-features", target.features);
+            const auto TTI = TM.getTargetTransformInfo(*F);
+            obfus::MBAShape shape;
+            if (llvm::StringRef(shape_name) == "balanced") {
+                shape.balanced = true;
+            } else if (llvm::StringRef(shape_name) == "target") {
+                shape = obfus::TargetMBAShape(TTI, *F);
+            }
+
+            llvm::IRBuilder<> ir_builder(llvm::BasicBlock::Create(context, "entry", F));
+            obfus::MBABuilder builder(ir_builder, true, shape);
+            const std::vector<llvm::Value *> vars{F->getArg(0), F->getArg(1), F->getArg(2)};
+            ir_builder.CreateRet(obfus::GenerateRandomMBAIdentity(builder, rng, type, vars));
+            path += CriticalPath(TTI, *F);
+        }
+        const size_t instructions = AsmInstructions(TM, module);
+        llvm::outs() << "target=" << target.name << " type=" << type_name << " shape=" << shape_name
+                     << " critical_path=" << llvm::format("%.1f", static_cast<double>(path) / kShapeIdentities)
+                     << " instructions=" << llvm::format("%.1f", static_cast<double>(instructions) / kShapeIdentities - 1) << "\n";
+    }
+}
+
+int main(void) {
+    llvm::LLVMContext context;
+    llvm::Module module("mba_bench", context);
+    const auto int_type = llvm::Type::getInt32Ty(context);
+    const std::vector<llvm::Type *> params(kMaxBenchVars, int_type);
+    const auto F = llvm::Function::Create(llvm::FunctionType::get(int_type, params, false),
+                                          llvm::Function::ExternalLinkage, "bench", module);
+    std::vector<llvm::Value *> args;
+    for (auto &arg : F->args()) {
+        args.emplace_back(&arg);
+    }
+
+    obfus::Random rng(obfus::kDefaultSeed);
+    for (int vars_count = 2; vars_count <= 3; vars_count++) {
+        const std::vector<llvm::Value *> vars(args.begin(), args.begin() + vars_count);
+        const double sampled = IdentitiesPerSecond(*F, rng, vars, obfus::MBASource::kRejectionSampling);
+        const double table = IdentitiesPerSecond(*F, rng, vars, obfus::MBASource::kTable);
+        llvm::outs() << "vars=" << vars_count << " rejection_sampling=" << static_cast<int64_t>(sampled)
+                     << "/s table=" << static_cast<int64_t>(table) << "/s speedup=" << llvm::format("%.1f", table / sampled) << "x\n";
+    }
+    for (int vars_count = 2; vars_count <= kMaxBenchVars; vars_count++) {
+        const std::vector<llvm::Value *> vars(args.begin(), args.begin() + vars_count);
+        const double solved = IdentitiesPerSecond(*F, rng, vars, obfus::MBASource::kSolver);
+        const auto rewrite = RewriteCost(*F, args, vars_count);
+        llvm::outs() << "vars=" << vars_count << " solver=" << static_cast<int64_t>(solved) << "/s cost=" << llvm::format("%.2f", 1e6 / solved)
+                     << "us/identity rewrite=" << llvm::format("%.2f", rewrite.first) << "us/identity instructions=" << llvm::format("%.1f", rewrite.second)
+                     << "/identity\n";
+    }
+    for (int vars_count = 2; vars_count <= 3; vars_count++) {
+        const size_t plain = BlockSize(*F, args, vars_count, false);
+        const size_t shared = BlockSize(*F, args, vars_count, true);
+        llvm::outs() << "vars=" << vars_count << " operators=" << kBlockOperators << " instructions_before=" << plain
+                     << " instructions_after=" << shared << " saved=" << llvm::format("%.1f", 100.0 * (plain - shared) / plain) << "%\n";
+    }
+
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmPrinters();
+    const std::pair<const char *, llvm::Type *(*)(llvm::LLVMContext &)> types[] = {
+        {"i32", [](llvm::LLVMContext &context) -> llvm::Type * { return llvm::Type::getInt32Ty(context); }},
+        {"i64", [](llvm::LLVMContext &context) -> llvm::Type * { return llvm::Type::getInt64Ty(context); }},
+        {"v4i32", [](llvm::LLVMContext &context) -> llvm::Type * { return llvm::FixedVectorType::get(llvm::Type::getInt32Ty(context), 4); }},
+        {"v16i32", [](llvm::LLVMContext &context) -> llvm::Type * { return llvm::FixedVectorType::get(llvm::Type::getInt32Ty(context), 16); }},
+    };
+    for (const auto &target : kTargets) {
+        std::string error;
+        const auto registered = llvm::TargetRegistry::lookupTarget(target.triple, error);
+        if (!registered) {
+            llvm::outs() << "target=" << target.name << " skipped: " << error << "\n";
+            continue;
+        }
+        std::unique_ptr<llvm::TargetMachine> TM(registered->createTargetMachine(target.triple, target.cpu, target.features, llvm::TargetOptions(), llvm::None));
+        for (const auto &type : types) {
+            CompareShapes(target, *TM, type.second, type.first);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+# runtime overhead and code size of bench/kernels.c (hashing, parsing, a
+# state machine, tight arithmetic loops) unobfuscated and under each
+# combination of the transforms.  one line per build and kernel:
+#   build=<name> kernel=<name> time_ms=<best of REPETITIONS> instructions=<retired, or na without perf events> result=<n> text_bytes=<kernel size>
+# plus build=<name> text_bytes=<.text of the whole binary>, all collected in
+# bench/overhead_results.txt.  every build has to compute what plain does
+# run from the repository root after build.sh
+set -eux
+
+CFLAGS="-O2 -std=c89 -D_POSIX_C_SOURCE=199309L"
+# -load registers the plugin's options so -mllvm can see them
+PLUGIN="-fexperimental-new-pass-manager -fpass-plugin=./obfus.so -Xclang -load -Xclang ./obfus.so"
+N=${N:-200}
+REPETITIONS=${REPETITIONS:-5}
+RESULTS=bench/overhead_results.txt
+
+: > $RESULTS
+# build=<name>:<-obfus-pipeline parameters>, plain builds without the plugin.
+# mba-depth=0 turns off constants as well unless they are asked for, so the
+# flatten rows are flattening alone and mba1/mba2 include constants
+for config in \
+    "plain:" \
+    "constants:no-flatten;mba-depth=0;constants" \
+    "mba1:no-flatten;mba-depth=1" \
+    "mba2:no-flatten;mba-depth=2" \
+    "flatten_ssa:flatten=ssa;mba-depth=0" \
+    "flatten_reg2mem:flatten=reg2mem;mba-depth=0" \
+    "flatten_indirectbr:flatten=indirectbr;mba-depth=0" \
+    "flatten_loops:flatten=loops;mba-depth=0" \
+    "full:flatten=ssa;mba-depth=2" \
+    "full_loops:flatten=loops;mba-depth=2"; do
+    build=${config%%:*}
+    params=${config#*:}
+    flags=""
+    if [ "$build" != "plain" ]; then
+        flags="$PLUGIN -mllvm -obfus-pipeline=$params"
+    fi
+    binary=bench/overhead_$build
+    clang-11 bench/kernels.c bench/kernels_main.c -o $binary $CFLAGS $flags
+
+    echo "build=$build text_bytes=$(llvm-size-11 -A $binary | awk '$1 == ".text" { print $2 }')" | tee -a $RESULTS
+    $binary $N $REPETITIONS > $binary.txt
+    while read -r line; do
+        kernel=$(echo "$line" | sed 's/^kernel=\([^ ]*\) .*/\1/')
+        size=$(llvm-nm-11 -S --defined-only $binary | awk -v kernel=$kernel '$4 == kernel { print $2 }')
+        echo "build=$build $line text_bytes=$((0x$size))" | tee -a $RESULTS
+    done < $binary.txt
+
+    sed 's/^\(kernel=[^ ]*\) .* \(result=[^ ]*\)$/\1 \2/' $binary.txt > $binary.results
+    cmp bench/overhead_plain.results $binary.results
+done
@@ -0,0 +1,24 @@
+#!/bin/sh
+# runtime of bench/kernels.c unobfuscated, obfuscated, and obfuscated with
+# profile guidance (hot blocks get lighter MBA and are not flattened)
+# run from the repository root after build.sh
+set -eux
+
+CFLAGS="-O2 -std=c89 -D_POSIX_C_SOURCE=199309L"
+# -load registers the plugin's options so -mllvm can see them
+PLUGIN="-fexperimental-new-pass-manager -fpass-plugin=./obfus.so -Xclang -load -Xclang ./obfus.so"
+SOURCES="bench/kernels.c bench/kernels_main.c"
+N=200
+
+clang-11 $SOURCES -o bench/kernels_plain $CFLAGS
+clang-11 $SOURCES -o bench/kernels_instrumented $CFLAGS -fprofile-instr-generate
+LLVM_PROFILE_FILE=bench/kernels.profraw ./bench/kernels_instrumented $N
+llvm-profdata-11 merge -o bench/kernels.profdata bench/kernels.profraw
+
+clang-11 $SOURCES -o bench/kernels_obfus $CFLAGS $PLUGIN
+clang-11 $SOURCES -o bench/kernels_obfus_pgo $CFLAGS $PLUGIN -fprofile-instr-use=bench/kernels.profdata
+clang-11 $SOURCES -o bench/kernels_obfus_pgo_light $CFLAGS $PLUGIN -fprofile-instr-use=bench/kernels.profdata -mllvm -obfus-hot-mba-depth=1
+
+for build in plain obfus obfus_pgo obfus_pgo_light; do
+    ./bench/kernels_$build $N | sed "s/^/build=$build /"
+done
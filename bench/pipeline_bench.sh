@@ -0,0 +1,42 @@
+#!/bin/sh
+# compile time and runtime of bench/kernels.c and test/test.c with the pass
+# at each extension point (-obfus-pipeline), next to an unobfuscated build
+# run from the repository root after build.sh
+set -eux
+
+CFLAGS="-O2 -std=c89 -D_POSIX_C_SOURCE=199309L"
+# -load registers the plugin's options so -mllvm can see them
+PLUGIN="-fexperimental-new-pass-manager -fpass-plugin=./obfus.so -Xclang -load -Xclang ./obfus.so"
+N=200
+
+now() {
+    date +%s.%N
+}
+
+# build=<name>:<-obfus-pipeline parameters>, plain builds without the plugin
+for config in \
+    "plain:" \
+    "start:ep=pipeline-start" \
+    "start_light:mba-depth=1;ep=pipeline-start" \
+    "last:ep=optimizer-last" \
+    "last_light:mba-depth=1;ep=optimizer-last" \
+    "last_no_flatten:no-flatten;ep=optimizer-last"; do
+    build=${config%%:*}
+    params=${config#*:}
+    flags=""
+    if [ "$build" != "plain" ]; then
+        flags="$PLUGIN -mllvm -obfus-pipeline=$params"
+    fi
+
+    start=$(now)
+    clang-11 bench/kernels.c bench/kernels_main.c -o bench/kernels_ep_$build $CFLAGS $flags
+    clang-11 test/test.c -o bench/test_ep_$build $CFLAGS $flags
+    end=$(now)
+    echo "build=$build compile_s=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')"
+
+    ./bench/kernels_ep_$build $N | sed "s/^/build=$build /"
+    start=$(now)
+    ./bench/test_ep_$build > /dev/null
+    end=$(now)
+    echo "build=$build test_ms=$(echo "$start $end" | awk '{ printf "%.3f", ($2 - $1) * 1000 }')"
+done
@@ -0,0 +1,47 @@
+#!/bin/sh
+# time to build VARIANTS differently seeded objects of bench/kernels.c: a
+# full clang invocation per variant against one front end (clang -O2
+# -emit-llvm) plus obfus-driver -variants.  both obfuscate after the
+# optimizer (ep=optimizer-last) so the code is comparable.  every variant is
+# linked and has to compute what the plain build does
+# run from the repository root after build.sh
+set -eux
+
+CFLAGS="-O2 -std=c89 -D_POSIX_C_SOURCE=199309L"
+# -load registers the plugin's options so -mllvm can see them
+PLUGIN="-fexperimental-new-pass-manager -fpass-plugin=./obfus.so -Xclang -load -Xclang ./obfus.so"
+VARIANTS=${VARIANTS:-100}
+N=20
+
+now() {
+    date +%s.%N
+}
+
+# kernel=<name> result=<n>
+results() {
+    "$@" $N | sed 's/ time_ms=[^ ]*//; s/ instructions=[^ ]*//'
+}
+
+mkdir -p bench/variants
+clang-11 -c bench/kernels_main.c -o bench/variants/main.o $CFLAGS
+clang-11 bench/kernels.c bench/variants/main.o -o bench/variants/plain $CFLAGS
+results ./bench/variants/plain > bench/variants/plain.txt
+
+start=$(now)
+for i in $(seq 0 $((VARIANTS - 1))); do
+    clang-11 -c bench/kernels.c -o bench/variants/clang.$i.o $CFLAGS $PLUGIN -mllvm -obfus-pipeline="ep=optimizer-last;seed=$((1 + i))"
+done
+end=$(now)
+echo "build=clang variants=$VARIANTS seconds=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')"
+
+start=$(now)
+clang-11 -c -emit-llvm bench/kernels.c -o bench/variants/kernels.bc $CFLAGS
+./obfus-driver bench/variants/kernels.bc -o bench/variants/driver.%v.o -c -variants $VARIANTS
+end=$(now)
+echo "build=obfus-driver variants=$VARIANTS seconds=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')"
+
+for i in $(seq 0 $((VARIANTS - 1))); do
+    clang-11 bench/variants/driver.$i.o bench/variants/main.o -o bench/variants/driver_$i
+    results ./bench/variants/driver_$i > bench/variants/driver_$i.txt
+    cmp bench/variants/plain.txt bench/variants/driver_$i.txt
+done
@@ -0,0 +1,181 @@
+/*
+Throughput benchmark for MBA on integer vector code.
+Builds checksum style kernels that walk a buffer 128 bits at a time as
+<4 x i32> and <16 x i8> (the shape the loop vectorizer gives our crypto and
+checksum loops), rewrites them with TransformBinaryOperatorBasicBlock and
+TransformIntegerConstants, JITs both versions and reports throughput of the
+obfuscated kernel relative to the plain one.  Also counts the integer
+operators left in scalar and vector form to show the rewrite stayed SIMD.
+usage: vector_bench [rounds]
+*/
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "../Random.hpp"
+#include "../Transforms.hpp"
+
+static const constexpr int kRepetitions = 3;
+static const constexpr uint64_t kBufferBytes = 64 * 1024;
+
+struct Kernel {
+    const char *name;
+    unsigned lanes;
+    unsigned lane_bits;
+};
+
+static const Kernel kKernels[] = {
+    {"v4i32", 4, 32},
+    {"v16i8", 16, 8},
+};
+
+// void mix_<name>(<lanes x iN> *data, i64 count, <lanes x iN> *out)
+static void BuildKernel(llvm::Module &M, const Kernel &kernel) {
+    auto &context = M.getContext();
+    llvm::IRBuilder<> builder(context);
+    const auto vector_type = llvm::FixedVectorType::get(builder.getIntNTy(kernel.lane_bits), kernel.lanes);
+    const auto pointer_type = vector_type->getPointerTo();
+    const auto F = llvm::Function::Create(llvm::FunctionType::get(builder.getVoidTy(), {pointer_type, builder.getInt64Ty(), pointer_type}, false),
+                                          llvm::Function::ExternalLinkage, std::string("mix_") + kernel.name, M);
+    const auto data = F->getArg(0);
+    const auto count = F->getArg(1);
+    const auto out = F->getArg(2);
+    const auto splat = [&](const uint64_t value) {
+        return llvm::ConstantInt::get(vector_type, value);
+    };
+
+    const auto entry = llvm::BasicBlock::Create(context, "entry", F);
+    const auto loop = llvm::BasicBlock::Create(context, "loop", F);
+    const auto exit = llvm::BasicBlock::Create(context, "exit", F);
+    builder.SetInsertPoint(entry);
+    builder.CreateBr(loop);
+
+    builder.SetInsertPoint(loop);
+    const auto i = builder.CreatePHI(builder.getInt64Ty(), 2);
+    const auto acc = builder.CreatePHI(vector_type, 2);
+    const auto value = builder.CreateLoad(vector_type, builder.CreateInBoundsGEP(vector_type, data, i));
+    llvm::Value *mixed = builder.CreateXor(acc, value);
+    mixed = builder.CreateAdd(mixed, builder.CreateAnd(value, splat(0x5a)));
+    mixed = builder.CreateSub(mixed, builder.CreateOr(builder.CreateXor(value, splat(0x33)), acc));
+    const auto large = builder.CreateICmpUGT(value, splat(100));
+    mixed = builder.CreateAdd(mixed, builder.CreateSelect(large, value, acc));
+    const auto next = builder.CreateAdd(i, builder.getInt64(1));
+    builder.CreateCondBr(builder.CreateICmpULT(next, count), loop, exit);
+    i->addIncoming(builder.getInt64(0), entry);
+    i->addIncoming(next, loop);
+    acc->addIncoming(splat(0x1234), entry);
+    acc->addIncoming(mixed, loop);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateStore(mixed, out);
+    builder.CreateRetVoid();
+}
+
+struct OperatorCount {
+    uint64_t scalar = 0;
+    uint64_t vector = 0;
+};
+
+static OperatorCount CountOperators(const llvm::Module &M) {
+    OperatorCount count;
+    for (const auto &F : M) {
+        for (const auto &BB : F) {
+            for (const auto &I : BB) {
+                if (!llvm::isa<llvm::BinaryOperator>(I)) {
+                    continue;
+                }
+                if (I.getType()->isVectorTy()) {
+                    count.vector++;
+                } else {
+                    count.scalar++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+struct Result {
+    double seconds;
+    OperatorCount operators;
+    std::vector<uint8_t> output;
+};
+
+static Result Run(const Kernel &kernel, const bool obfuscate, const std::vector<uint8_t> &buffer, const uint64_t rounds) {
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = std::make_unique<llvm::Module>("vector_bench", *context);
+    BuildKernel(*module, kernel);
+    if (obfuscate) {
+        for (auto &F : *module) {
+            if (F.isDeclaration()) {
+                continue;
+            }
+            auto rng = obfus::Random::ForFunction(obfus::kDefaultSeed, F.getName());
+            // like the pass: constants first, the pools are left alone
+            const std::vector<llvm::BasicBlock *> blocks(llvm::pointer_iterator<llvm::Function::iterator>(F.begin()), llvm::pointer_iterator<llvm::Function::iterator>(F.end()));
+            obfus::TransformIntegerConstants(F, rng);
+            for (const auto BB : blocks) {
+                obfus::TransformBinaryOperatorBasicBlock(*BB, rng);
+            }
+        }
+    }
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        std::exit(EXIT_FAILURE);
+    }
+
+    Result result{1e100, CountOperators(*module), std::vector<uint8_t>(16)};
+    auto jit = llvm::cantFail(llvm::orc::LLJITBuilder().create());
+    llvm::cantFail(jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+    const auto mix = reinterpret_cast<void (*)(const uint8_t *, uint64_t, uint8_t *)>(
+        llvm::cantFail(jit->lookup(std::string("mix_") + kernel.name)).getAddress());
+
+    for (int repetition = 0; repetition < kRepetitions; repetition++) {
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t round = 0; round < rounds; round++) {
+            mix(buffer.data(), buffer.size() / 16, result.output.data());
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.seconds = std::min(result.seconds, elapsed.count());
+    }
+    return result;
+}
+
+int main(const int argc, const char **argv) {
+    const uint64_t rounds = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 2000;
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    std::vector<uint8_t> buffer(kBufferBytes);
+    obfus::Random rng(obfus::kDefaultSeed);
+    for (auto &byte : buffer) {
+        byte = rng.Uniform(256);
+    }
+
+    for (const auto &kernel : kKernels) {
+        const auto plain = Run(kernel, false, buffer, rounds);
+        const auto obfuscated = Run(kernel, true, buffer, rounds);
+        if (plain.output != obfuscated.output) {
+            llvm::errs() << kernel.name << ": obfuscated result differs\n";
+            return EXIT_FAILURE;
+        }
+        const double bytes = static_cast<double>(buffer.size()) * rounds;
+        llvm::outs() << "kernel=" << kernel.name << " plain_gbps=" << llvm::format("%.2f", bytes / plain.seconds / 1e9)
+                     << " obfuscated_gbps=" << llvm::format("%.2f", bytes / obfuscated.seconds / 1e9)
+                     << " relative=" << llvm::format("%.2f", plain.seconds / obfuscated.seconds)
+                     << " vector_ops=" << plain.operators.vector << "->" << obfuscated.operators.vector
+                     << " scalar_ops=" << plain.operators.scalar << "->" << obfuscated.operators.scalar << "\n";
+    }
+    return EXIT_SUCCESS;
+}
@@ -6,7 +6,12 @@ CFLAGS="$CFLAGS -DDEBUG=1"
 CFLAGS="$CFLAGS -Wall -Wextra -Wstrict-prototypes -pedantic -Wno-unused-parameter"
 CFLAGS="$CFLAGS -flto -Ofast -march=native -fmerge-all-constants"
 # CFLAGS="$CFLAGS -fsanitize=leak"
-clang-format-11 -i -style="{BasedOnStyle: Google, IndentWidth: 4, ColumnLimit: 0}" *.cpp *.hpp test/*.c
+clang-format-11 -i -style="{BasedOnStyle: Google, IndentWidth: 4, ColumnLimit: 0}" *.cpp *.hpp test/*.c tools/*.cpp jit/*.cpp jit/*.hpp
 clang++-11 *.cpp $(llvm-config-11 --cxxflags) -o obfus.so $CFLAGS
 
+# parallel driver, the same sources linked into an executable
+DRIVER_CFLAGS="-fno-rtti -std=c++17 -pthread -O2 -march=native"
+DRIVER_CFLAGS="$DRIVER_CFLAGS -Wall -Wextra -Wstrict-prototypes -pedantic -Wno-unused-parameter"
+clang++-11 tools/obfus-driver.cpp *.cpp $(llvm-config-11 --cxxflags --ldflags --libs core irreader bitreader bitwriter linker passes transformutils native) -o obfus-driver $DRIVER_CFLAGS
+
 # clang++-11 -fexperimental-new-pass-manager -fpass-plugin=./obfus.so *.cpp $(llvm-config-11 --cxxflags) -o obfus1.so $CFLAGS
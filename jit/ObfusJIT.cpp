@@ -0,0 +1,67 @@
+#include "ObfusJIT.hpp"
+
+#include <llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+
+#include <chrono>
+#include <random>
+#include <utility>
+
+namespace obfus {
+uint64_t ProcessSeed() {
+    std::random_device device;
+    return (static_cast<uint64_t>(device()) << 32) | device();
+}
+
+ObfusTransform::ObfusTransform(const ObfusOptions &options, std::unique_ptr<llvm::TargetMachine> TM) : state_(std::make_shared<State>()) {
+    state_->options = options;
+    state_->TM = std::move(TM);
+}
+
+llvm::Expected<llvm::orc::ThreadSafeModule> ObfusTransform::operator()(llvm::orc::ThreadSafeModule TSM, llvm::orc::MaterializationResponsibility &R) {
+    TSM.withModuleDo([&](llvm::Module &M) {
+        uint64_t functions = 0;
+        for (const auto &F : M) {
+            functions += (F.isDeclaration()) ? 0 : 1;
+        }
+        // the globals partition has none
+        if (functions == 0) {
+            return;
+        }
+
+        const std::lock_guard<std::mutex> lock(state_->mutex);
+        const auto start = std::chrono::steady_clock::now();
+        ObfuscateModule(M, state_->options, state_->TM.get());
+        const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+        state_->functions += functions;
+        state_->nanoseconds += elapsed.count();
+    });
+    return TSM;
+}
+
+llvm::Expected<std::unique_ptr<llvm::TargetMachine>> HostTargetMachine() {
+    auto builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!builder) {
+        return builder.takeError();
+    }
+    return builder->createTargetMachine();
+}
+
+llvm::Expected<std::unique_ptr<llvm::orc::LLLazyJIT>> CreateObfusJIT(const ObfusTransform &transform) {
+    auto jit = llvm::orc::LLLazyJITBuilder().create();
+    if (!jit) {
+        return jit.takeError();
+    }
+    // one function per partition, the others stay behind their stubs
+    (*jit)->setPartitionFunction(llvm::orc::CompileOnDemandLayer::compileRequested);
+    (*jit)->getIRTransformLayer().setTransform(transform);
+
+    auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*jit)->getDataLayout().getGlobalPrefix());
+    if (!generator) {
+        return generator.takeError();
+    }
+    (*jit)->getMainJITDylib().addGenerator(std::move(*generator));
+    return jit;
+}
+}  // namespace obfus
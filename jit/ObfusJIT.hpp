@@ -0,0 +1,65 @@
+#ifndef OBFUS_JIT_HPP
+#define OBFUS_JIT_HPP
+
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "../Obfus.hpp"
+
+namespace obfus {
+// a seed for this process alone, from std::random_device
+uint64_t ProcessSeed();
+
+/*
+IR transform for an ORC IRTransformLayer: runs the pass (ObfuscateModule) on
+every function defined in the module the layer hands over.  Under
+CreateObfusJIT that is one function, the first time it is called, so every
+process that picks its own seed runs differently obfuscated code from the
+same IR.  Copies share their state, ORC wants a copyable function object.
+*/
+class ObfusTransform {
+   public:
+    // TM is only the cost model, it never generates code
+    ObfusTransform(const ObfusOptions &options, std::unique_ptr<llvm::TargetMachine> TM);
+
+    llvm::Expected<llvm::orc::ThreadSafeModule> operator()(llvm::orc::ThreadSafeModule TSM, llvm::orc::MaterializationResponsibility &R);
+
+    // totals over every module transformed so far, for whoever reports latency
+    uint64_t Functions() const {
+        return state_->functions;
+    }
+    uint64_t Nanoseconds() const {
+        return state_->nanoseconds;
+    }
+
+   private:
+    struct State {
+        ObfusOptions options;
+        std::unique_ptr<llvm::TargetMachine> TM;
+        // the pass and TargetMachine's subtarget cache are not thread safe,
+        // codegen of other functions can still run next to it
+        std::mutex mutex;
+        std::atomic<uint64_t> functions{0};
+        std::atomic<uint64_t> nanoseconds{0};
+    };
+    std::shared_ptr<State> state_;
+};
+
+// the host's TargetMachine, for ObfusTransform's cost model
+llvm::Expected<std::unique_ptr<llvm::TargetMachine>> HostTargetMachine();
+
+// a lazy JIT for the host that compiles each function on its first call,
+// after transform has run on it.  keep a copy of transform to read its
+// totals.  process symbols (libc, ...) resolve in the main JITDylib
+llvm::Expected<std::unique_ptr<llvm::orc::LLLazyJIT>> CreateObfusJIT(const ObfusTransform &transform);
+}  // namespace obfus
+
+#endif
@@ -10,3 +10,108 @@ clang-11 -fexperimental-new-pass-manager -fpass-plugin=./obfus.so test/test.c -o
 # clang-11 test/test.c -o test/test $CFLAGS
 
 ./test/test
+# the dispatchers show up in the debug info as an inlined frame of their own
+llvm-dwarfdump-11 --debug-info test/test | grep -q '"obfus.dispatcher"'
+
+# C++ exceptions: the functions with try/catch and destructors are flattened
+# in every mode (the DEBUG build logs them) and still behave
+for mode in ssa reg2mem indirectbr loops; do
+    clang++-11 -fexperimental-new-pass-manager -fpass-plugin=./obfus.so -Xclang -load -Xclang ./obfus.so -mllvm -obfus-pipeline="flatten=$mode" test/eh_test.cpp -o test/eh_test_$mode -O2 2> test/eh_test_$mode.log
+    grep -q "Flattened.*sum_caught" test/eh_test_$mode.log
+    grep -q "Flattened.*guarded" test/eh_test_$mode.log
+    ./test/eh_test_$mode
+    # the Windows (funclet) shapes of the same functions are left alone
+    opt-11 -load-pass-plugin=./obfus.so -passes="obfus<flatten=$mode>,verify" test/eh_funclet.ll -o /dev/null 2> test/eh_test_funclet_$mode.log
+    grep -q "Flattened.*may_throw" test/eh_test_funclet_$mode.log
+    if grep -q "Flattened.*\(sum_caught\|guarded\)" test/eh_test_funclet_$mode.log; then
+        exit 1
+    fi
+    # so are functions with asm goto, and both callbr survive
+    opt-11 -load-pass-plugin=./obfus.so -passes="obfus<flatten=$mode>,verify" test/callbr.ll -S -o test/callbr_$mode.ll 2> test/callbr_$mode.log
+    grep -q "Flattened.*plain_branches" test/callbr_$mode.log
+    test "$(grep -c "^ *callbr " test/callbr_$mode.ll)" -eq 2
+    if grep -q "Flattened.*asm_" test/callbr_$mode.log; then
+        exit 1
+    fi
+done
+
+# same module obfuscated on 1 thread and on N threads must give identical bitcode
+CXXFLAGS="-fno-rtti -std=c++17 -pthread"
+clang-11 -S -emit-llvm test/test.c -o test/test.ll -g -std=c89
+clang++-11 test/determinism_test.cpp CostBudget.cpp DeriveZeroMBA.cpp MBABuilder.cpp Nullspace.cpp Obfus.cpp Selection.cpp Transforms.cpp Cache.cpp $(llvm-config-11 --cxxflags --ldflags --libs core irreader bitreader bitwriter passes transformutils) -o test/determinism_test $CXXFLAGS
+./test/determinism_test test/test.ll 8
+# indirectbr tables are added in the order functions are flattened and
+# sorted once the module is done
+sed -E '/^define /s/ (#[0-9]+)/ \1 "obfus-flatten-mode"="indirectbr"/' test/test.ll > test/test_indirectbr.ll
+./test/determinism_test test/test_indirectbr.ll 8
+
+# cost budgets: 0 adds no identities, a percentage grows the code less than
+# no budget, and a tight one downgrades identities instead of going over it
+# (the DEBUG build logs what each function spent)
+instructions_after() {
+    sed -n 's/.*instructions [0-9]* -> \([0-9]*\).*/\1/p' "$1" | awk '{ n += $1 } END { print n }'
+}
+opt-11 -load=./obfus.so -load-pass-plugin=./obfus.so -pass-remarks=obfus -passes=obfus test/test.ll -o /dev/null 2> test/budget_unlimited.log
+opt-11 -load=./obfus.so -load-pass-plugin=./obfus.so -pass-remarks=obfus -passes=obfus test/test.ll -o /dev/null -obfus-cost-budget=0 2> test/budget_0.log
+grep -q "with 0 identities" test/budget_0.log
+if grep "^remark" test/budget_0.log | grep -v -q "with 0 identities"; then
+    exit 1
+fi
+opt-11 -load=./obfus.so -load-pass-plugin=./obfus.so -pass-remarks=obfus -passes=obfus test/test.ll -o /dev/null -obfus-cost-budget-percent=5 2> test/budget_percent.log
+test "$(instructions_after test/budget_percent.log)" -lt "$(instructions_after test/budget_unlimited.log)"
+opt-11 -load=./obfus.so -load-pass-plugin=./obfus.so -pass-remarks=obfus -passes=obfus test/test.ll -o /dev/null -obfus-cost-budget=20 2> test/budget_tight.log
+grep -q "with [1-9][0-9]* identities" test/budget_tight.log
+awk '/^Cost budget: spent/ && $4 + 0 > $6 + 0 { exit 1 }' test/budget_tight.log
+
+# random integer functions against their obfuscated clones, both JIT compiled
+clang++-11 test/equivalence_test.cpp Cache.cpp CostBudget.cpp DeriveZeroMBA.cpp MBABuilder.cpp Nullspace.cpp Obfus.cpp Selection.cpp Transforms.cpp $(llvm-config-11 --cxxflags --ldflags --libs core irreader bitreader bitwriter passes transformutils orcjit native) -o test/equivalence_test -O2 $CXXFLAGS
+./test/equivalence_test 20000
+
+# the parallel driver: the obfuscated tests still pass and the thread count
+# does not change the output
+./obfus-driver test/test.ll -o test/test_driver_1.bc -j 1
+./obfus-driver test/test.ll -o test/test_driver.bc -j 8
+cmp test/test_driver_1.bc test/test_driver.bc
+clang-11 test/test_driver.bc -o test/test_driver
+./test/test_driver
+# -mcpu reaches codegen for functions without a target-cpu of their own,
+# and a CPU the target does not know is an error
+sed -E 's/"target-(cpu|features)"="[^"]*"//g' test/test.ll > test/test_driver_no_target.ll
+./obfus-driver test/test_driver_no_target.ll -o test/test_driver_generic.o -c
+./obfus-driver test/test_driver_no_target.ll -o test/test_driver_native.o -c -mcpu=native
+if cmp -s test/test_driver_generic.o test/test_driver_native.o; then
+    exit 1
+fi
+clang-11 test/test_driver_native.o -o test/test_driver_native
+./test/test_driver_native
+if ./obfus-driver test/test.ll -o test/test_driver_bogus.o -c -mcpu=bogus; then
+    exit 1
+fi
+
+# selection rules split on tabs and runs of spaces like on a single space,
+# and the config does change the output
+sed 's/[[:space:]][[:space:]]*/ /g' test/selection.cfg > test/selection_spaces.cfg
+./obfus-driver test/test.ll -o test/test_selection.bc -obfus-config=test/selection.cfg
+./obfus-driver test/test.ll -o test/test_selection_spaces.bc -obfus-config=test/selection_spaces.cfg
+cmp test/test_selection.bc test/test_selection_spaces.bc
+if cmp -s test/test_selection.bc test/test_driver_1.bc; then
+    exit 1
+fi
+clang-11 test/test_selection.bc -o test/test_selection
+./test/test_selection
+
+# a warm cache gives the same module as the cold run that filled it
+rm -rf test/cache
+./obfus-driver test/test.ll -o test/test_cache_cold.ll -S -obfus-cache-dir=test/cache
+./obfus-driver test/test.ll -o test/test_cache_warm.ll -S -obfus-cache-dir=test/cache
+cmp test/test_cache_cold.ll test/test_cache_warm.ll
+
+# differently seeded variants from one parse, each one still passes the tests
+./obfus-driver test/test.ll -o test/test_variant.%v.o -c -variants 3
+for i in 0 1 2; do
+    clang-11 test/test_variant.$i.o -o test/test_variant_$i
+    ./test/test_variant_$i
+done
+if cmp -s test/test_variant.0.o test/test_variant.1.o; then
+    exit 1
+fi
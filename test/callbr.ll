@@ -0,0 +1,58 @@
+; asm goto (callbr) jumps to its labels from inside the asm, so flattening
+; can neither dispatch those edges nor drop the callbr, even one without
+; indirect labels.  test.sh checks that every mode leaves asm_goto and
+; asm_fallthrough alone (both callbr stay in the output) while still
+; flattening plain_branches next to them, and that the output verifies
+
+define dso_local i32 @plain_branches(i32 %x) {
+entry:
+  %cmp = icmp sgt i32 %x, 0
+  br i1 %cmp, label %positive, label %other
+
+positive:
+  %add = add nsw i32 %x, 1
+  br label %done
+
+other:
+  %sub = sub nsw i32 0, %x
+  br label %done
+
+done:
+  %r = phi i32 [ %add, %positive ], [ %sub, %other ]
+  ret i32 %r
+}
+
+define dso_local i32 @asm_goto(i32 %x) {
+entry:
+  %cmp = icmp sgt i32 %x, 0
+  br i1 %cmp, label %check, label %zero
+
+check:
+  callbr void asm sideeffect "testl $0, $0; jne ${1:l}", "r,X,~{dirflag},~{fpsr},~{flags}"(i32 %x, i8* blockaddress(@asm_goto, %taken))
+          to label %normal [label %taken]
+
+normal:
+  ret i32 1
+
+taken:
+  ret i32 2
+
+zero:
+  ret i32 0
+}
+
+define dso_local i32 @asm_fallthrough(i32 %x) {
+entry:
+  %cmp = icmp sgt i32 %x, 0
+  br i1 %cmp, label %check, label %zero
+
+check:
+  callbr void asm sideeffect "nop", "~{dirflag},~{fpsr},~{flags}"()
+          to label %normal []
+
+normal:
+  ret i32 1
+
+zero:
+  ret i32 0
+}
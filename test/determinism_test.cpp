@@ -0,0 +1,101 @@
+/*
+Obfuscates the same module on 1 thread and on N threads (each thread in its
+own LLVMContext, visiting functions in a different order) and checks the
+resulting bitcode is byte identical.
+usage: determinism_test <module.ll|module.bc> [threads]
+*/
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../Obfus.hpp"
+#include "../Selection.hpp"
+
+// parse path in a fresh context, obfuscate every function in the order given
+// by rotating the function list by rotation (reversed if reverse is set) and
+// return the bitcode
+static std::string ObfuscateModule(const char *path, const size_t rotation, const bool reverse) {
+    llvm::LLVMContext context;
+    llvm::SMDiagnostic error;
+    const auto module = llvm::parseIRFile(path, error, context);
+    if (!module) {
+        error.print("determinism_test", llvm::errs());
+        std::exit(EXIT_FAILURE);
+    }
+
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::PassBuilder PB;
+    PB.registerModuleAnalyses(MAM);
+    MAM.registerPass([] { return obfus::SelectionAnalysis(); });
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    std::vector<llvm::Function *> functions;
+    for (auto &F : *module) {
+        if (!F.isDeclaration()) {
+            functions.emplace_back(&F);
+        }
+    }
+    if (!functions.empty()) {
+        std::rotate(functions.begin(), functions.begin() + (rotation % functions.size()), functions.end());
+    }
+    if (reverse) {
+        std::reverse(functions.begin(), functions.end());
+    }
+
+    obfus::Obfus pass;
+    for (const auto F : functions) {
+        pass.run(*F, FAM);
+        FAM.invalidate(*F, llvm::PreservedAnalyses::none());
+    }
+    obfus::SortDispatchTables(*module);
+
+    std::string bitcode;
+    llvm::raw_string_ostream stream(bitcode);
+    llvm::WriteBitcodeToFile(*module, stream);
+    return stream.str();
+}
+
+int main(const int argc, const char **argv) {
+    if (argc < 2) {
+        llvm::errs() << "usage: " << argv[0] << " <module> [threads]\n";
+        return EXIT_FAILURE;
+    }
+    const size_t threads_count = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : std::thread::hardware_concurrency();
+
+    const auto expected = ObfuscateModule(argv[1], 0, false);
+
+    std::vector<std::string> results(threads_count);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threads_count; i++) {
+        threads.emplace_back([&, i]() { results[i] = ObfuscateModule(argv[1], i, i % 2); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < threads_count; i++) {
+        if (results[i] != expected) {
+            llvm::errs() << "thread " << i << ": bitcode differs from the single threaded run\n";
+            failures++;
+        }
+    }
+    llvm::outs() << "Checked " << threads_count << " threads against the single threaded run: " << failures << " mismatches\n";
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
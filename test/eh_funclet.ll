@@ -0,0 +1,105 @@
+; Windows C++ exceptions (funclet pads) in the shapes clang gives
+; test/eh_test.cpp's sum_caught and guarded for x86_64-pc-windows-msvc.
+; Flattening would move blocks out of their funclets, so test.sh checks that
+; every mode leaves these two alone while still flattening may_throw next to
+; them, and that the output verifies
+target datalayout = "e-m:w-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-windows-msvc"
+
+%rtti.TypeDescriptor2 = type { i8**, i8*, [3 x i8] }
+
+@"??_7type_info@@6B@" = external constant i8*
+@"??_R0H@8" = linkonce_odr global %rtti.TypeDescriptor2 { i8** @"??_7type_info@@6B@", i8* null, [3 x i8] c".H\00" }, comdat
+
+$"??_R0H@8" = comdat any
+
+declare dso_local void @_CxxThrowException(i8*, i8*)
+
+declare dso_local i32 @__CxxFrameHandler3(...)
+
+declare dso_local void @release(i32)
+
+define dso_local i32 @may_throw(i32 %x) {
+entry:
+  %rem = srem i32 %x, 3
+  %cmp = icmp eq i32 %rem, 0
+  br i1 %cmp, label %throw, label %ok
+
+throw:
+  call void @_CxxThrowException(i8* null, i8* null)
+  unreachable
+
+ok:
+  %mul = shl nsw i32 %x, 1
+  ret i32 %mul
+}
+
+; the loop of sum_caught, a catch (int) handler going back into it
+define dso_local i32 @sum_caught(i32 %n) personality i8* bitcast (i32 (...)* @__CxxFrameHandler3 to i8*) {
+entry:
+  %thrown = alloca i32, align 4
+  %cmp.entry = icmp sgt i32 %n, 0
+  br i1 %cmp.entry, label %loop, label %exit
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %value = invoke i32 @may_throw(i32 %i)
+          to label %cont unwind label %dispatch
+
+cont:
+  %added = add nsw i32 %value, %sum
+  br label %latch
+
+dispatch:
+  %switch = catchswitch within none [label %handler] unwind to caller
+
+handler:
+  %pad = catchpad within %switch [%rtti.TypeDescriptor2* @"??_R0H@8", i32 0, i32* %thrown]
+  catchret from %pad to label %caught
+
+caught:
+  %loaded = load i32, i32* %thrown, align 4
+  %subtracted = sub nsw i32 %sum, %loaded
+  br label %latch
+
+latch:
+  %sum.next = phi i32 [ %added, %cont ], [ %subtracted, %caught ]
+  %next = add nuw nsw i32 %i, 1
+  %done = icmp eq i32 %next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  %result = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  ret i32 %result
+}
+
+; guarded's destructor, run by a cleanup pad on the way out
+define dso_local i32 @guarded(i32 %x) personality i8* bitcast (i32 (...)* @__CxxFrameHandler3 to i8*) {
+entry:
+  %first = invoke i32 @may_throw(i32 %x)
+          to label %cont unwind label %cleanup
+
+cont:
+  %cmp = icmp sgt i32 %first, 20
+  br i1 %cmp, label %again, label %done
+
+again:
+  %plus = add nsw i32 %x, 1
+  %second = invoke i32 @may_throw(i32 %plus)
+          to label %cont.again unwind label %cleanup
+
+cont.again:
+  %diff = sub nsw i32 %second, %first
+  br label %done
+
+done:
+  %result = phi i32 [ %first, %cont ], [ %diff, %cont.again ]
+  call void @release(i32 %x)
+  ret i32 %result
+
+cleanup:
+  %pad = cleanuppad within none []
+  call void @release(i32 %x) [ "funclet"(token %pad) ]
+  cleanupret from %pad unwind to caller
+}
@@ -0,0 +1,101 @@
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+/*
+C++ exceptions under flattening: invokes inside loops, catch blocks that
+carry values back into the loop, destructors run by cleanup pads on the way
+out and rethrows across obfuscated frames.  test.sh builds it once per
+flattening mode, and checks every mode skips the Windows funclet versions of
+sum_caught and guarded in test/eh_funclet.ll
+*/
+
+static int destroyed = 0;
+
+struct Guard {
+    ~Guard() {
+        destroyed++;
+    }
+};
+
+static int __attribute__((noinline)) may_throw(const int x) {
+    if (x % 3 == 0) {
+        throw x;
+    }
+    if (x % 7 == 0) {
+        throw std::runtime_error("seven");
+    }
+    return x * 2;
+}
+
+// the normal path adds, the catch blocks subtract or add and the loop goes on
+static int __attribute__((noinline)) sum_caught(const int n) {
+    int sum = 0;
+    for (int i = 0; i < n; i++) {
+        try {
+            sum += may_throw(i) + may_throw(i + 1);
+        } catch (const int thrown) {
+            sum -= thrown;
+        } catch (const std::exception &) {
+            sum += 1000;
+        }
+    }
+    return sum;
+}
+
+// nothing caught, the cleanup pad runs the destructor and resumes
+static int __attribute__((noinline)) guarded(const int x) {
+    Guard guard;
+    int result = may_throw(x);
+    if (result > 20) {
+        result = may_throw(x + 1) - result;
+    }
+    return result;
+}
+
+// guarded's exceptions are caught one frame up, next to an inner loop
+static int __attribute__((noinline)) nested(const int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 4; j++) {
+            total += j * i;
+        }
+        try {
+            total += guarded(i);
+        } catch (...) {
+            total -= 100;
+        }
+    }
+    return total;
+}
+
+static int __attribute__((noinline)) rethrown(const int x) {
+    try {
+        try {
+            return may_throw(x);
+        } catch (const int thrown) {
+            if (thrown > 5) {
+                throw;
+            }
+            return -thrown;
+        }
+    } catch (const int thrown) {
+        return thrown * 10;
+    }
+}
+
+#define EXPECT_EQ(name, x, y) ((x == y) ? 0 : printf("EXPECT_EQ: %s: %d != %d\n", name, x, y))
+
+int main(void) {
+    EXPECT_EQ("sum_caught(0)", sum_caught(0), 0);
+    EXPECT_EQ("sum_caught(1)", sum_caught(1), 0);
+    EXPECT_EQ("sum_caught(50)", sum_caught(50), 7435);
+    EXPECT_EQ("nested(30)", nested(30), 678);
+    EXPECT_EQ("destroyed", destroyed, 30);
+    EXPECT_EQ("rethrown(1)", rethrown(1), 2);
+    EXPECT_EQ("rethrown(3)", rethrown(3), -3);
+    EXPECT_EQ("rethrown(9)", rethrown(9), 90);
+
+    printf("Finished tests!\n");
+    return EXIT_SUCCESS;
+}
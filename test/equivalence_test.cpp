@@ -0,0 +1,440 @@
+/*
+Differential test of the whole pass.  Every case is a random integer
+function (arithmetic, comparisons, selects, if/else, switches and loops over
+i1/i8/i32/i64) next to its obfuscated clone; both are compiled with ORC
+LLJIT and must return the same value for edge case and random inputs.
+Cases are spread over threads, every thread compiles a batch of cases into
+one LLJIT at a time.  The flattening mode, MBA depth and MBA variables rotate
+with the case number, and a case only depends on the seed and its number, so
+a failure is reported with the IR that reproduces it.
+usage: equivalence_test [cases] [threads] [seed]
+*/
+#include <llvm/ADT/Twine.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../Obfus.hpp"
+#include "../Random.hpp"
+#include "../Selection.hpp"
+
+// cases compiled into one LLJIT before it is thrown away
+static const constexpr uint64_t kBatchSize = 64;
+// inputs per case, the first quarter built from kEdgeValues
+static const constexpr int kInputs = 1024;
+static const constexpr int kArguments = 4;
+// nesting of loops and branches in a generated function
+static const constexpr int kMaxDepth = 3;
+// a case running this long has an obfuscated clone that never returns (a
+// broken dispatcher), the watchdog reports it and stops the test
+static const constexpr auto kTimeout = std::chrono::seconds(10);
+
+static const uint64_t kEdgeValues[] = {
+    0, 1, 2, 3, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff, 0x7fffffff, 0x80000000, 0xffffffff, 0x7fffffffffffffff, 0x8000000000000000,
+    0xfffffffffffffffe, 0xffffffffffffffff, 0x5555555555555555, 0xaaaaaaaaaaaaaaaa,
+};
+
+static const struct {
+    obfus::FlattenMode mode;
+    const char *name;
+} kFlattenModes[] = {
+    {obfus::FlattenMode::kSSA, "ssa"},
+    {obfus::FlattenMode::kReg2Mem, "reg2mem"},
+    {obfus::FlattenMode::kIndirectBr, "indirectbr"},
+    {obfus::FlattenMode::kLoops, "loops"},
+};
+
+using TestFunction = uint64_t (*)(uint64_t, uint64_t, uint64_t, uint64_t);
+
+// builds i64 f(i64, i64, i64, i64) out of well defined operations only:
+// shift amounts are masked, divisors have their low bit set and loops run
+// 1 to 8 times, so the original and the clone must agree on every input
+class FunctionGenerator {
+   public:
+    FunctionGenerator(llvm::Module &M, obfus::Random &rng) : M_(M), rng_(rng), builder_(M.getContext()) {}
+
+    llvm::Function *Generate(const llvm::Twine &name) {
+        auto &context = M_.getContext();
+        const auto i64 = llvm::Type::getInt64Ty(context);
+        const auto type = llvm::FunctionType::get(i64, std::vector<llvm::Type *>(kArguments, i64), false);
+        F_ = llvm::Function::Create(type, llvm::GlobalValue::ExternalLinkage, name, M_);
+        builder_.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", F_));
+        for (auto &argument : F_->args()) {
+            values_.emplace_back(&argument);
+        }
+
+        Region(kMaxDepth);
+        llvm::Value *result = Pick(i64);
+        for (int i = 0; i < 3; i++) {
+            result = builder_.CreateXor(builder_.CreateMul(result, builder_.getInt64(0x9e3779b97f4a7c15)), Pick(i64));
+        }
+        builder_.CreateRet(result);
+        return F_;
+    }
+
+   private:
+    llvm::Type *RandomType() {
+        static const unsigned kWidths[] = {1, 8, 32, 64};
+        return builder_.getIntNTy(kWidths[rng_.Uniform(4)]);
+    }
+
+    // a value in scope or a constant, truncated or extended to type
+    llvm::Value *Pick(llvm::Type *type) {
+        if (rng_.Uniform(8) == 0) {
+            return llvm::ConstantInt::get(type, (rng_.Uniform(2)) ? kEdgeValues[rng_.Uniform(std::size(kEdgeValues))] : rng_());
+        }
+        const auto value = values_[values_.size() - 1 - rng_.Uniform(std::min<size_t>(values_.size(), 12))];
+        const auto from = value->getType()->getIntegerBitWidth();
+        const auto to = type->getIntegerBitWidth();
+        if (from > to) {
+            return builder_.CreateTrunc(value, type);
+        }
+        if (from < to) {
+            return (rng_.Uniform(2)) ? builder_.CreateZExt(value, type) : builder_.CreateSExt(value, type);
+        }
+        return value;
+    }
+
+    llvm::Value *BinaryOperator(llvm::Value *lhs, llvm::Value *rhs) {
+        const auto type = lhs->getType();
+        const auto mask = llvm::ConstantInt::get(type, type->getIntegerBitWidth() - 1);
+        switch (rng_.Uniform(11)) {
+            case 0:
+                return builder_.CreateAdd(lhs, rhs);
+            case 1:
+                return builder_.CreateSub(lhs, rhs);
+            case 2:
+                return builder_.CreateMul(lhs, rhs);
+            case 3:
+                return builder_.CreateAnd(lhs, rhs);
+            case 4:
+                return builder_.CreateOr(lhs, rhs);
+            case 5:
+                return builder_.CreateXor(lhs, rhs);
+            case 6:
+                return builder_.CreateShl(lhs, builder_.CreateAnd(rhs, mask));
+            case 7:
+                return builder_.CreateLShr(lhs, builder_.CreateAnd(rhs, mask));
+            case 8:
+                return builder_.CreateAShr(lhs, builder_.CreateAnd(rhs, mask));
+            case 9:
+                return builder_.CreateUDiv(lhs, builder_.CreateOr(rhs, llvm::ConstantInt::get(type, 1)));
+            default:
+                return builder_.CreateURem(lhs, builder_.CreateOr(rhs, llvm::ConstantInt::get(type, 1)));
+        }
+    }
+
+    llvm::Value *Comparison() {
+        static const llvm::CmpInst::Predicate kPredicates[] = {
+            llvm::CmpInst::ICMP_EQ, llvm::CmpInst::ICMP_NE, llvm::CmpInst::ICMP_UGT, llvm::CmpInst::ICMP_UGE, llvm::CmpInst::ICMP_ULT,
+            llvm::CmpInst::ICMP_ULE, llvm::CmpInst::ICMP_SGT, llvm::CmpInst::ICMP_SGE, llvm::CmpInst::ICMP_SLT, llvm::CmpInst::ICMP_SLE,
+        };
+        const auto type = RandomType();
+        return builder_.CreateICmp(kPredicates[rng_.Uniform(std::size(kPredicates))], Pick(type), Pick(type));
+    }
+
+    void Straight() {
+        for (uint64_t count = 1 + rng_.Uniform(6); count > 0; count--) {
+            const auto type = RandomType();
+            switch (rng_.Uniform(8)) {
+                case 0:
+                    values_.emplace_back(Comparison());
+                    break;
+                case 1:
+                    values_.emplace_back(builder_.CreateSelect(Comparison(), Pick(type), Pick(type)));
+                    break;
+                default:
+                    values_.emplace_back(BinaryOperator(Pick(type), Pick(type)));
+                    break;
+            }
+        }
+    }
+
+    // if/else or a three case switch, joined by a phi
+    void Branch(const int depth) {
+        auto &context = M_.getContext();
+        const bool is_switch = rng_.Uniform(3) == 0;
+        const auto arms_count = (is_switch) ? 4 : 2;
+        std::vector<llvm::BasicBlock *> arms;
+        for (int i = 0; i < arms_count; i++) {
+            arms.emplace_back(llvm::BasicBlock::Create(context, "arm", F_));
+        }
+        const auto merge = llvm::BasicBlock::Create(context, "merge", F_);
+        if (is_switch) {
+            const auto condition = builder_.CreateAnd(Pick(builder_.getInt32Ty()), 3);
+            const auto instruction = builder_.CreateSwitch(condition, arms[3], 3);
+            for (int i = 0; i < 3; i++) {
+                instruction->addCase(builder_.getInt32(i), arms[i]);
+            }
+        } else {
+            builder_.CreateCondBr(Comparison(), arms[0], arms[1]);
+        }
+
+        const auto type = RandomType();
+        const auto phi = llvm::PHINode::Create(type, arms_count, "join", merge);
+        const auto scope = values_.size();
+        for (const auto arm : arms) {
+            builder_.SetInsertPoint(arm);
+            Region(depth - 1);
+            phi->addIncoming(Pick(type), builder_.GetInsertBlock());
+            builder_.CreateBr(merge);
+            values_.resize(scope);
+        }
+        builder_.SetInsertPoint(merge);
+        values_.emplace_back(phi);
+    }
+
+    // do/while with a counter and an accumulator, 1 to 8 iterations
+    void Loop(const int depth) {
+        auto &context = M_.getContext();
+        const auto i32 = builder_.getInt32Ty();
+        const auto preheader = builder_.GetInsertBlock();
+        const auto trip_count = builder_.CreateAdd(builder_.CreateAnd(Pick(i32), 7), builder_.getInt32(1));
+        const auto type = RandomType();
+        const auto initial = Pick(type);
+        const auto header = llvm::BasicBlock::Create(context, "loop", F_);
+        builder_.CreateBr(header);
+
+        builder_.SetInsertPoint(header);
+        const auto counter = builder_.CreatePHI(i32, 2, "i");
+        const auto accumulator = builder_.CreatePHI(type, 2, "acc");
+        const auto scope = values_.size();
+        values_.emplace_back(counter);
+        values_.emplace_back(accumulator);
+        Region(depth - 1);
+        const auto next_accumulator = BinaryOperator(accumulator, Pick(type));
+        const auto next_counter = builder_.CreateAdd(counter, builder_.getInt32(1));
+        const auto latch = builder_.GetInsertBlock();
+        const auto exit = llvm::BasicBlock::Create(context, "exit", F_);
+        builder_.CreateCondBr(builder_.CreateICmpULT(next_counter, trip_count), header, exit);
+        counter->addIncoming(builder_.getInt32(0), preheader);
+        counter->addIncoming(next_counter, latch);
+        accumulator->addIncoming(initial, preheader);
+        accumulator->addIncoming(next_accumulator, latch);
+
+        values_.resize(scope);
+        builder_.SetInsertPoint(exit);
+        values_.emplace_back(next_accumulator);
+    }
+
+    void Region(const int depth) {
+        for (uint64_t count = 1 + rng_.Uniform(3); count > 0; count--) {
+            const auto kind = (depth > 0) ? rng_.Uniform(4) : 0;
+            if (kind == 2) {
+                Branch(depth);
+            } else if (kind == 3) {
+                Loop(depth);
+            } else {
+                Straight();
+            }
+        }
+    }
+
+    llvm::Module &M_;
+    obfus::Random &rng_;
+    llvm::IRBuilder<> builder_;
+    llvm::Function *F_ = nullptr;
+    std::vector<llvm::Value *> values_;
+};
+
+static obfus::ObfusOptions CaseOptions(const uint64_t seed, const uint64_t index) {
+    obfus::ObfusOptions options;
+    options.seed = seed + index;
+    options.flatten_mode = kFlattenModes[index % std::size(kFlattenModes)].mode;
+    options.mba_depth = 1 + (index / std::size(kFlattenModes)) % 2;
+    // 2 to kMaxMBAVars, above 3 the identities come from the solver
+    options.mba_vars = 2 + (index / (2 * std::size(kFlattenModes))) % (obfus::kMaxMBAVars - 1);
+    return options;
+}
+
+// "ref_<index>" and its obfuscated clone "obf_<index>", nullptr if the pass
+// produced invalid IR (reported by the verifier)
+static std::unique_ptr<llvm::Module> GenerateCase(llvm::LLVMContext &context, llvm::TargetMachine &TM, const uint64_t seed, const uint64_t index) {
+    auto module = std::make_unique<llvm::Module>("case_" + std::to_string(index), context);
+    module->setDataLayout(TM.createDataLayout());
+    module->setTargetTriple(TM.getTargetTriple().str());
+    obfus::Random rng((seed << 32) ^ index);
+    const auto original = FunctionGenerator(*module, rng).Generate("ref_" + llvm::Twine(index));
+
+    llvm::ValueToValueMapTy VMap;
+    const auto clone = llvm::CloneFunction(original, VMap);
+    clone->setName("obf_" + llvm::Twine(index));
+
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::PassBuilder PB(&TM);
+    PB.registerModuleAnalyses(MAM);
+    MAM.registerPass([] { return obfus::SelectionAnalysis(); });
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    obfus::Obfus(CaseOptions(seed, index)).run(*clone, FAM);
+
+    if (llvm::verifyModule(*module, &llvm::errs())) {
+        return nullptr;
+    }
+    return module;
+}
+
+static std::vector<uint64_t> CaseInputs(const uint64_t seed, const uint64_t index) {
+    obfus::Random rng(~((seed << 32) ^ index));
+    std::vector<uint64_t> inputs(kInputs * kArguments);
+    for (int i = 0; i < kInputs * kArguments; i++) {
+        if (i < kInputs * kArguments / 4) {
+            inputs[i] = kEdgeValues[rng.Uniform(std::size(kEdgeValues))];
+        } else {
+            // small values keep loops and comparisons interesting
+            inputs[i] = (rng.Uniform(2)) ? rng() : rng.Uniform(64);
+        }
+    }
+    return inputs;
+}
+
+static uint64_t LookupAddress(llvm::orc::LLJIT &jit, const std::string &name) {
+#if LLVM_VERSION_MAJOR >= 15
+    return llvm::cantFail(jit.lookup(name)).getValue();
+#else
+    return llvm::cantFail(jit.lookup(name)).getAddress();
+#endif
+}
+
+struct Totals {
+    std::atomic<uint64_t> cases{0};
+    std::atomic<uint64_t> executions{0};
+    std::atomic<uint64_t> failures{0};
+    std::mutex report_mutex;
+};
+
+// what a thread is executing, for the watchdog
+struct Worker {
+    static const constexpr uint64_t kIdle = UINT64_MAX;
+    std::atomic<uint64_t> running_case{kIdle};
+    std::atomic<std::chrono::steady_clock::rep> started{0};
+};
+
+static void Report(Totals &totals, llvm::TargetMachine &TM, const uint64_t seed, const uint64_t index, const llvm::Twine &message) {
+    totals.failures++;
+    const std::lock_guard<std::mutex> lock(totals.report_mutex);
+    const auto options = CaseOptions(seed, index);
+    llvm::errs() << "case " << index << " (seed " << seed << ", flatten mode " << kFlattenModes[index % std::size(kFlattenModes)].name
+                 << ", mba depth " << options.mba_depth << ", mba vars " << options.mba_vars << "): " << message << "\n";
+    // regenerated, cases are deterministic
+    llvm::LLVMContext context;
+    const auto module = GenerateCase(context, TM, seed, index);
+    if (module) {
+        module->getFunction(("ref_" + llvm::Twine(index)).str())->print(llvm::errs());
+    }
+}
+
+static void CheckBatch(Totals &totals, Worker &worker, llvm::TargetMachine &TM, const uint64_t seed, const uint64_t first, const uint64_t last) {
+    // fast isel, codegen of the obfuscated clones dominates otherwise
+    auto builder = llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost());
+    builder.setCodeGenOptLevel(llvm::CodeGenOpt::None);
+    auto jit = llvm::cantFail(llvm::orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(builder)).create());
+    std::vector<uint64_t> compiled;
+    for (uint64_t index = first; index < last; index++) {
+        auto context = std::make_unique<llvm::LLVMContext>();
+        auto module = GenerateCase(*context, TM, seed, index);
+        if (!module) {
+            Report(totals, TM, seed, index, "obfuscated function does not verify");
+            continue;
+        }
+        llvm::cantFail(jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+        compiled.emplace_back(index);
+    }
+
+    for (const auto index : compiled) {
+        const auto original = reinterpret_cast<TestFunction>(LookupAddress(*jit, "ref_" + std::to_string(index)));
+        const auto obfuscated = reinterpret_cast<TestFunction>(LookupAddress(*jit, "obf_" + std::to_string(index)));
+        const auto inputs = CaseInputs(seed, index);
+        worker.started = std::chrono::steady_clock::now().time_since_epoch().count();
+        worker.running_case = index;
+        for (int i = 0; i < kInputs; i++) {
+            const auto x = &inputs[i * kArguments];
+            const auto expected = original(x[0], x[1], x[2], x[3]);
+            const auto actual = obfuscated(x[0], x[1], x[2], x[3]);
+            if (expected != actual) {
+                Report(totals, TM, seed, index,
+                       llvm::Twine("f(") + llvm::Twine(x[0]) + ", " + llvm::Twine(x[1]) + ", " + llvm::Twine(x[2]) + ", " + llvm::Twine(x[3]) +
+                           ") = " + llvm::Twine(actual) + ", expected " + llvm::Twine(expected));
+                break;
+            }
+        }
+        worker.running_case = Worker::kIdle;
+        totals.cases++;
+        totals.executions += 2 * kInputs;
+    }
+}
+
+int main(const int argc, const char **argv) {
+    const uint64_t cases = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 10000;
+    const size_t threads_count = (argc > 2 && std::strtoul(argv[2], nullptr, 10) > 0) ? std::strtoul(argv[2], nullptr, 10) : std::thread::hardware_concurrency();
+    const uint64_t seed = (argc > 3) ? std::strtoull(argv[3], nullptr, 10) : obfus::kDefaultSeed;
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    Totals totals;
+    std::vector<Worker> workers(threads_count);
+    std::atomic<size_t> finished{0};
+    std::atomic<uint64_t> next_batch{0};
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < threads_count; i++) {
+        threads.emplace_back([&, i]() {
+            // TargetMachine is not thread safe, every thread has its own
+            const auto TM = llvm::cantFail(llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost()).createTargetMachine());
+            for (uint64_t first = next_batch.fetch_add(kBatchSize); first < cases; first = next_batch.fetch_add(kBatchSize)) {
+                CheckBatch(totals, workers[i], *TM, seed, first, std::min(first + kBatchSize, cases));
+            }
+            finished++;
+        });
+    }
+
+    const auto TM = llvm::cantFail(llvm::cantFail(llvm::orc::JITTargetMachineBuilder::detectHost()).createTargetMachine());
+    while (finished < threads_count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const auto now = std::chrono::steady_clock::now().time_since_epoch();
+        for (const auto &worker : workers) {
+            const uint64_t index = worker.running_case;
+            if (index != Worker::kIdle && now - std::chrono::steady_clock::duration(worker.started) > kTimeout) {
+                Report(totals, *TM, seed, index, "obfuscated function did not return");
+                // the hung thread cannot be stopped
+                std::_Exit(EXIT_FAILURE);
+            }
+        }
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    llvm::outs() << "Checked " << totals.cases << " cases, " << totals.executions << " executions in " << llvm::format("%.1f", elapsed.count())
+                 << "s (" << llvm::format("%.0f", totals.executions * 60 / elapsed.count()) << "/min) on " << threads_count
+                 << " threads: " << totals.failures << " mismatches\n";
+    return (totals.failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
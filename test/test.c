@@ -41,7 +41,7 @@ static uint8_t __attribute__((const)) __attribute__((optnone)) password8(const u
     }
 }
 
-static int16_t __attribute__((const)) __attribute__((optnone)) password16(const int16_t input) {
+static int16_t __attribute__((const)) __attribute__((optnone)) __attribute__((annotate("obfus=light"))) password16(const int16_t input) {
     if (input >= 0 && input < 5 && (input & 1) == 0) {
         return 5000;
     } else {
@@ -49,7 +49,7 @@ static int16_t __attribute__((const)) __attribute__((optnone)) password16(const
     }
 }
 
-static int __attribute__((const)) __attribute__((optnone)) return5000(void) {
+static int __attribute__((const)) __attribute__((optnone)) __attribute__((annotate("obfus=none"))) return5000(void) {
     return 5000;
 }
 
@@ -0,0 +1,308 @@
+/*
+Obfuscates a module on several threads, for unity builds and full LTO links
+where the pass alone runs on one.  The module is split into partitions
+(llvm::SplitModule, local symbols stay in the partition of their users so
+nothing is renamed), each partition is obfuscated in its own LLVMContext on a
+thread pool and the results are linked back in partition order.
+
+The output only depends on the input, the options and -partitions, never on
+-j or on which thread ran what: every function gets its Random stream from
+the seed and its own name.
+
+With -variants=N the module is parsed (and -pre-passes run on it) once and
+N differently seeded copies are obfuscated in parallel, one per thread, for
+shipping a distinct build to every customer without N front ends.  Variant
+i gets seed -variant-seed + i and is written to -o with %v replaced by i;
+with -c every variant goes through codegen on its thread as well.
+
+The pass (its cost model and target aware MBA shapes) and codegen share a
+TargetMachine for the module's triple, -mcpu and -mattr, like opt and llc.
+Every thread builds its own, a TargetMachine is not thread safe.
+usage: obfus-driver <module.bc|module.ll> -o <output> [-j threads] [-partitions n]
+                    [-params 'flatten=loops;seed=1'] [-S | -c] [-mcpu cpu] [-mattr features]
+                    [pass options like -obfus-config]
+       obfus-driver <module.bc|module.ll> -o <output.%v.o> -variants n [-variant-seed s]
+                    [-pre-passes 'default<O2>'] [-c] ...
+*/
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/MC/TargetRegistry.h>
+#else
+#include <llvm/Support/TargetRegistry.h>
+#endif
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../Obfus.hpp"
+#include "../Selection.hpp"
+
+static llvm::cl::opt<std::string> kInput(llvm::cl::Positional, llvm::cl::desc("<module.bc|module.ll>"), llvm::cl::Required);
+static llvm::cl::opt<std::string> kOutput("o", llvm::cl::desc("Output file"), llvm::cl::value_desc("filename"), llvm::cl::Required);
+static llvm::cl::opt<unsigned> kThreads("j", llvm::cl::desc("Worker threads (0 = one per core)"), llvm::cl::init(0));
+static llvm::cl::opt<unsigned> kPartitions(
+    "partitions", llvm::cl::desc("Parts the module is split into, more than threads balances better (the output depends on it)"),
+    llvm::cl::init(32));
+static llvm::cl::opt<std::string> kParams("params", llvm::cl::desc("Pass parameters as in obfus<...>, e.g. 'flatten=loops;mba-depth=1;seed=1'"), llvm::cl::init(""));
+static llvm::cl::opt<bool> kText("S", llvm::cl::desc("Write textual IR instead of bitcode"));
+static llvm::cl::opt<bool> kObject("c", llvm::cl::desc("Write a native object file instead of bitcode"));
+static llvm::cl::opt<unsigned> kVariants("variants", llvm::cl::desc("Differently seeded copies of the module to write (%v in -o is the index)"), llvm::cl::init(1));
+static llvm::cl::opt<uint64_t> kVariantSeed("variant-seed", llvm::cl::desc("Seed of variant 0, variant i gets this plus i (overrides seed= in -params)"),
+                                            llvm::cl::init(obfus::kDefaultSeed));
+static llvm::cl::opt<std::string> kPrePasses("pre-passes", llvm::cl::desc("Pipeline run once before the variants are made, e.g. 'default<O2>'"), llvm::cl::init(""));
+static llvm::cl::opt<std::string> kCPU("mcpu", llvm::cl::desc("Target CPU, 'native' for the host's"), llvm::cl::value_desc("cpu"), llvm::cl::init("generic"));
+static llvm::cl::opt<std::string> kFeatures("mattr", llvm::cl::desc("Target features, e.g. '+avx2,-sse4.2'"), llvm::cl::value_desc("a1,+a2,-a3"),
+                                            llvm::cl::init(""));
+
+static std::string ObfusPipeline(const std::string &params) {
+    return (params.empty()) ? "obfus" : "obfus<" + params + ">";
+}
+
+// variant i is the pipeline with its own seed, last seed= wins
+static std::string VariantParams(const unsigned variant) {
+    return ((kParams.empty()) ? "" : kParams + ";") + "seed=" + std::to_string(kVariantSeed + variant);
+}
+
+// for the module's triple (the host's without one).  functions with
+// target-cpu or target-features attributes still get those, as in llc
+static llvm::Expected<std::unique_ptr<llvm::TargetMachine>> CreateTargetMachine(const llvm::Module &M) {
+    const auto triple = (M.getTargetTriple().empty()) ? llvm::sys::getDefaultTargetTriple() : M.getTargetTriple();
+    std::string error;
+    const auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target) {
+        return llvm::make_error<llvm::StringError>(error, llvm::inconvertibleErrorCode());
+    }
+    const auto cpu = (kCPU == "native") ? llvm::sys::getHostCPUName().str() : kCPU.getValue();
+    // the TargetMachine would only warn and may then fail in codegen
+    const std::unique_ptr<llvm::MCSubtargetInfo> STI(target->createMCSubtargetInfo(triple, "", ""));
+    if (!STI->isCPUStringValid(cpu)) {
+        return llvm::make_error<llvm::StringError>("'" + cpu + "' is not a CPU for " + triple, llvm::inconvertibleErrorCode());
+    }
+    return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(triple, cpu, kFeatures, llvm::TargetOptions(), llvm::Reloc::PIC_));
+}
+
+// the same pipeline opt builds for -passes=<pipeline>, so the plugin's own
+// option parsing, selection and analyses apply unchanged
+static llvm::Error BuildPipeline(llvm::PassBuilder &PB, llvm::ModulePassManager &MPM, const std::string &pipeline) {
+    llvmGetPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+    return PB.parsePassPipeline(MPM, pipeline);
+}
+
+// main checks every pipeline up front, parsing cannot fail here
+static void RunPipeline(llvm::Module &M, const std::string &pipeline, llvm::TargetMachine *TM) {
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+    llvm::PassBuilder PB(TM);
+    llvm::ModulePassManager MPM;
+    llvm::cantFail(BuildPipeline(PB, MPM, pipeline));
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    MPM.run(M, MAM);
+}
+
+// codegen with the TargetMachine the pass ran with
+static llvm::Error WriteObject(llvm::Module &M, llvm::TargetMachine &TM, llvm::raw_pwrite_stream &output) {
+    llvm::legacy::PassManager PM;
+#if LLVM_VERSION_MAJOR >= 18
+    const auto file_type = llvm::CodeGenFileType::ObjectFile;
+#else
+    const auto file_type = llvm::CGFT_ObjectFile;
+#endif
+    if (TM.addPassesToEmitFile(PM, output, nullptr, file_type)) {
+        return llvm::make_error<llvm::StringError>("no object file emission for " + TM.getTargetTriple().str(), llvm::inconvertibleErrorCode());
+    }
+    PM.run(M);
+    return llvm::Error::success();
+}
+
+static llvm::Error WriteOutput(llvm::Module &M, llvm::TargetMachine &TM, const std::string &path) {
+    std::error_code error;
+    llvm::raw_fd_ostream output(path, error, llvm::sys::fs::OF_None);
+    if (error) {
+        return llvm::make_error<llvm::StringError>(path + ": " + error.message(), error);
+    }
+    if (kObject) {
+        return WriteObject(M, TM, output);
+    }
+    if (kText) {
+        M.print(output, nullptr);
+    } else {
+        llvm::WriteBitcodeToFile(M, output);
+    }
+    return llvm::Error::success();
+}
+
+static std::string WriteBitcode(const llvm::Module &M) {
+    std::string bitcode;
+    llvm::raw_string_ostream stream(bitcode);
+    llvm::WriteBitcodeToFile(M, stream);
+    return stream.str();
+}
+
+static std::unique_ptr<llvm::Module> ReadBitcode(const std::string &bitcode, llvm::LLVMContext &context) {
+    const auto buffer = llvm::MemoryBuffer::getMemBuffer(bitcode, "partition", false);
+    return llvm::cantFail(llvm::parseBitcodeFile(*buffer, context));
+}
+
+// runs on a worker thread, everything it touches belongs to its own context
+// and TargetMachine.  main made one for the same triple, this one can not fail
+static std::string ObfuscatePartition(const std::string &bitcode) {
+    llvm::LLVMContext context;
+    const auto module = ReadBitcode(bitcode, context);
+    const auto TM = llvm::cantFail(CreateTargetMachine(*module));
+    RunPipeline(*module, ObfusPipeline(kParams), TM.get());
+    return WriteBitcode(*module);
+}
+
+// also on a worker thread: parsing the bitcode is the copy, a module can
+// not be cloned into another context
+static llvm::Error WriteVariant(const std::string &bitcode, const unsigned variant) {
+    llvm::LLVMContext context;
+    const auto module = ReadBitcode(bitcode, context);
+    const auto TM = llvm::cantFail(CreateTargetMachine(*module));
+    RunPipeline(*module, ObfusPipeline(VariantParams(variant)), TM.get());
+    auto path = kOutput.getValue();
+    path.replace(path.find("%v"), 2, std::to_string(variant));
+    return WriteOutput(*module, *TM, path);
+}
+
+// the module is serialized once, every variant parses its own copy
+static int MainVariants(llvm::Module &M, const char *argv0) {
+    const auto bitcode = WriteBitcode(M);
+    std::vector<std::string> errors(kVariants);
+    {
+        llvm::ThreadPool pool(llvm::hardware_concurrency(kThreads));
+        for (unsigned i = 0; i < kVariants; i++) {
+            pool.async([&, i]() {
+                if (auto error = WriteVariant(bitcode, i)) {
+                    errors[i] = llvm::toString(std::move(error));
+                }
+            });
+        }
+        pool.wait();
+    }
+    for (const auto &error : errors) {
+        if (!error.empty()) {
+            llvm::errs() << argv0 << ": " << error << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "parallel obfuscation driver\n");
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    if (kVariants > 1 && kOutput.find("%v") == std::string::npos) {
+        llvm::errs() << argv[0] << ": -variants needs %v in the output file name\n";
+        return EXIT_FAILURE;
+    }
+    if (kText && kObject) {
+        llvm::errs() << argv[0] << ": -S and -c are exclusive\n";
+        return EXIT_FAILURE;
+    }
+
+    llvm::LLVMContext context;
+    llvm::SMDiagnostic diagnostic;
+    auto module = llvm::parseIRFile(kInput, diagnostic, context);
+    if (!module) {
+        diagnostic.print(argv[0], llvm::errs());
+        return EXIT_FAILURE;
+    }
+    auto TM = CreateTargetMachine(*module);
+    if (!TM) {
+        llvm::errs() << argv[0] << ": " << llvm::toString(TM.takeError()) << "\n";
+        return EXIT_FAILURE;
+    }
+    for (const auto &pipeline : {ObfusPipeline(VariantParams(0)), kPrePasses.getValue()}) {
+        if (pipeline.empty()) {
+            continue;
+        }
+        llvm::PassBuilder PB(TM->get());
+        llvm::ModulePassManager MPM;
+        if (auto error = BuildPipeline(PB, MPM, pipeline)) {
+            llvm::errs() << argv[0] << ": " << llvm::toString(std::move(error)) << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // before splitting, llvm.global.annotations ends up in a single partition
+    obfus::AnnotationsToAttributes(*module);
+    if (!kPrePasses.empty()) {
+        RunPipeline(*module, kPrePasses, TM->get());
+    }
+    if (kVariants > 1) {
+        return MainVariants(*module, argv[0]);
+    }
+
+    // serialized right away, every partition is parsed again in the context
+    // of the thread obfuscating it
+    std::vector<std::string> partitions;
+    const auto add_partition = [&](std::unique_ptr<llvm::Module> partition) {
+        partitions.emplace_back(WriteBitcode(*partition));
+    };
+#if LLVM_VERSION_MAJOR >= 13
+    llvm::SplitModule(*module, std::max(1U, static_cast<unsigned>(kPartitions)), add_partition, true);
+#else
+    llvm::SplitModule(std::move(module), std::max(1U, static_cast<unsigned>(kPartitions)), add_partition, true);
+#endif
+    module.reset();
+
+    std::vector<std::string> results(partitions.size());
+    {
+        llvm::ThreadPool pool(llvm::hardware_concurrency(kThreads));
+        for (size_t i = 0; i < partitions.size(); i++) {
+            pool.async([&, i]() { results[i] = ObfuscatePartition(partitions[i]); });
+        }
+        pool.wait();
+    }
+
+    // partition order, not completion order
+    auto linked = std::make_unique<llvm::Module>(kInput, context);
+    llvm::Linker linker(*linked);
+    for (const auto &result : results) {
+        if (linker.linkInModule(ReadBitcode(result, context))) {
+            llvm::errs() << argv[0] << ": linking the partitions failed\n";
+            return EXIT_FAILURE;
+        }
+    }
+    // every partition sorted its own, one run for the whole module
+    obfus::SortDispatchTables(*linked);
+
+    if (auto error = WriteOutput(*linked, **TM, kOutput)) {
+        llvm::errs() << argv[0] << ": " << llvm::toString(std::move(error)) << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}